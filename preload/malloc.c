@@ -0,0 +1,500 @@
+#include "../src/include/buddy.h"
+#include "../src/include/shrink.h"
+#include "../src/include/spinlock.h"
+#include "../src/include/trace.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/**
+ * malloc() and friends on top of the buddy allocator, for running unmodified
+ * binaries with LD_PRELOAD=bin/libbuddy.so.
+ *
+ * Requests up to SMALL_MAX bytes are served by size classes, each carving
+ * objects out of slabs that are themselves buddy blocks. Anything larger is
+ * a buddy block of its own. A byte per arena page tells free() which of the
+ * two a pointer belongs to:
+ *
+ *  0                   not handed out.
+ *  PAGE_LARGE | order  first page of a large block of that order.
+ *  1 + i               page 'i' of a slab, the slab header is 'i' pages back.
+ *
+ * Allocations made while the heap is being set up, e.g. by the C library
+ * on our behalf, come from a small static bootstrap arena and are never
+ * reclaimed.
+ *
+ * Environment:
+ *  BUDDY_ARENA     arena size in MiB, default 4096. It is reserved, not
+ *                  committed, pages only cost memory once touched.
+ *  BUDDY_TRACE     record buddy block events to this file, see tools/replay.
+ */
+
+#define SMALL_MAX       2048            // largest request served by a size class.
+#define SLAB_HDR        64              // slab header size, also the largest small alignment.
+#define SLAB_MINOBJ     8               // objects a slab holds at the least.
+#define PAGE_LARGE      0x80            // page map tag of a large block.
+#define BOOT_SIZE       KiB(64)         // bootstrap arena.
+#define ARENA_DEFAULT   4096            // MiB.
+#define SHRINK_COST     1               // dropping cached slabs is almost free.
+
+#define ALIGN_UP(x, align) (((x) + ((align)-1)) & ~((align)-1))
+
+// Slab header, objects follow at SLAB_HDR.
+typedef struct slab_t {
+    struct slab_t   *next;      // on its class's partial list.
+    struct slab_t   *prev;
+    void            *free;      // objects freed back to the slab.
+    u32             cls;        // size class.
+    u32             nbump;      // objects never handed out, taken from the end.
+    u32             nfree;      // objects on 'free' plus nbump.
+} slab_t;
+
+_Static_assert(sizeof(slab_t) <= SLAB_HDR, "slab header too large");
+
+typedef struct class_t {
+    spinlock_t      lock;
+    slab_t          *partial;   // slabs with at least one free object.
+    slab_t          *empty;     // a fully free slab kept to avoid thrashing.
+    u32             size;       // object size.
+    u32             order;      // slab order.
+    u32             nobj;       // objects per slab.
+} class_t;
+
+static const u32 class_size[] = {
+    16,   32,   48,   64,   80,   96,   112,  128,
+    160,  192,  224,  256,  320,  384,  448,  512,
+    640,  768,  896,  1024, 1280, 1536, 1792, 2048,
+};
+
+#define NCLASS          NELEM(class_size)
+
+static class_t      classes[NCLASS];
+static u8           class_index[SMALL_MAX / 16 + 1];   // (size + 15) / 16 -> class.
+
+static buddy_zone_t *heap      = NULL;  // set once the heap is ready.
+static u8           *pagemap   = NULL;  // one tag per arena page.
+static spinlock_t   heap_lock  = SPINLOCK_INIT();
+static __thread int heap_setup = 0;     // this thread is setting the heap up.
+
+static u8           boot[BOOT_SIZE] __aligned(SLAB_HDR);
+static usize        boot_used  = 0;
+
+// Order of the smallest buddy block holding 'size' bytes, sizes past the
+// largest order stop there so the shift never wraps.
+static u32 size_order(usize size) {
+    u32 order = 0;
+    while (order < BUDDY_NORDER - 1 && (PGSZ << order) < size)
+        order++;
+    return order;
+}
+
+static usize page_index(void *ptr) {
+    return zone_off(heap, ptr) / PGSZ;
+}
+
+static int boot_owns(void *ptr) {
+    return (u8 *)ptr >= boot && (u8 *)ptr < boot + BOOT_SIZE;
+}
+
+// Bump allocation with a size prefix so realloc() can move it out, the
+// memory is static and never reused, so it is always zeroed.
+static void *boot_alloc(usize size, usize align) {
+    align = align < 16 ? 16 : align;
+    if (size > BOOT_SIZE || align > SLAB_HDR)
+        return NULL;
+
+    usize used = __atomic_load_n(&boot_used, __ATOMIC_RELAXED);
+    usize off  = 0;
+    do {
+        off = ALIGN_UP(used + sizeof(usize), align);
+        if (off + size > BOOT_SIZE)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&boot_used, &used, off + size, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    ((usize *)(boot + off))[-1] = size;
+    return boot + off;
+}
+
+/**
+ * Hold every heap lock across fork() so the child never inherits one
+ * taken, in the order they nest. Shrinkers are registered under heap_lock
+ * and run from slab_new() under a class lock, once the zone lock is
+ * dropped. The trace lock is taken under the zone lock. Shrinkers only
+ * trylock the classes, so one running while we wait for it still ends.
+ */
+static void heap_fork_prepare(void) {
+    spin_lock(&heap_lock);
+    for (usize i = 0; i < NCLASS; ++i)
+        spin_lock(&classes[i].lock);
+    buddy_shrink_lock();
+    spin_lock(&heap->lock);
+    buddy_trace_lock();
+}
+
+static void heap_fork_parent(void) {
+    buddy_trace_unlock();
+    spin_unlock(&heap->lock);
+    buddy_shrink_unlock();
+    for (usize i = NCLASS; i--;)
+        spin_unlock(&classes[i].lock);
+    spin_unlock(&heap_lock);
+}
+
+// The trace file stays the parent's, the child does not write to it.
+static void heap_fork_child(void) {
+    buddy_trace_fork_child();
+    spin_reset(&heap->lock);
+    buddy_shrink_unlock();
+    for (usize i = NCLASS; i--;)
+        spin_reset(&classes[i].lock);
+    spin_reset(&heap_lock);
+}
+
+static void slab_destroy(class_t *c, slab_t *s);
+
+// Shrinker, give the cached empty slabs back to the zone.
+static usize heap_shrink(void *arg __unused, int order __unused) {
+    usize total = 0;
+
+    for (usize i = 0; i < NCLASS; ++i) {
+        class_t *c = &classes[i];
+
+        // Whoever holds it may be the allocation waiting on us.
+        if (!spin_trylock(&c->lock))
+            continue;
+        if (c->empty) {
+            slab_destroy(c, c->empty);
+            c->empty = NULL;
+            total += PGSZ << c->order;
+        }
+        spin_unlock(&c->lock);
+    }
+    return total;
+}
+
+static int heap_init_locked(void) {
+    const char *env = getenv("BUDDY_ARENA");
+    usize size = MiB(env ? strtoull(env, NULL, 0) : ARENA_DEFAULT);
+
+    int err = buddy_init_size(size);
+    if (err) return err;
+
+    buddy_zone_t *z = buddy_zone();
+    pagemap = mmap(NULL, z->memsize / PGSZ, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pagemap == MAP_FAILED) {
+        buddy_fini();
+        return -ENOMEM;
+    }
+
+    for (usize i = 0, c = 0; i < NELEM(class_index); ++i) {
+        while (class_size[c] < i * 16)
+            c++;
+        class_index[i] = c;
+    }
+
+    for (usize i = 0; i < NCLASS; ++i) {
+        class_t *c = &classes[i];
+        c->lock  = SPINLOCK_INIT();
+        c->size  = class_size[i];
+        c->order = 0;
+        while (((PGSZ << c->order) - SLAB_HDR) / c->size < SLAB_MINOBJ)
+            c->order++;
+        c->nobj  = ((PGSZ << c->order) - SLAB_HDR) / c->size;
+    }
+
+    // The C library may allocate in here, that is served by the bootstrap arena.
+    pthread_atfork(heap_fork_prepare, heap_fork_parent, heap_fork_child);
+    buddy_shrinker_register(heap_shrink, NULL, SHRINK_COST);
+
+    if ((env = getenv("BUDDY_TRACE")))
+        buddy_trace_start(env);
+
+    __atomic_store_n(&heap, z, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Set the heap up on first use, -EAGAIN means this thread is doing so.
+static int heap_init(void) {
+    static int failed = 0;
+
+    if (__atomic_load_n(&heap, __ATOMIC_ACQUIRE))
+        return 0;
+    if (heap_setup)
+        return -EAGAIN;
+
+    spin_lock(&heap_lock);
+    heap_setup = 1;
+    if (!heap && !failed)
+        failed = heap_init_locked() != 0;
+    heap_setup = 0;
+    spin_unlock(&heap_lock);
+
+    return heap ? 0 : -ENOMEM;
+}
+
+__attribute__((destructor))
+static void heap_exit(void) {
+    // Later destructors may still free, so the zone itself stays mapped.
+    if (buddy_tracing)
+        buddy_trace_stop();
+}
+
+static slab_t *slab_new(class_t *c) {
+    slab_t *s = buddy_zone_alloc(heap, PGSZ << c->order);
+    if (!s) return NULL;
+
+    usize pg = page_index(s);
+    for (u32 i = 0; i < (1u << c->order); ++i)
+        pagemap[pg + i] = 1 + i;
+
+    s->next  = s->prev = NULL;
+    s->free  = NULL;
+    s->cls   = c - classes;
+    s->nbump = s->nfree = c->nobj;
+    return s;
+}
+
+static void slab_destroy(class_t *c, slab_t *s) {
+    memset(&pagemap[page_index(s)], 0, 1u << c->order);
+    buddy_zone_free_sized(heap, s, PGSZ << c->order);
+}
+
+static void slab_link(class_t *c, slab_t *s) {
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial)
+        c->partial->prev = s;
+    c->partial = s;
+}
+
+static void slab_unlink(class_t *c, slab_t *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+// The slab holding a small object, from the tag of the page it is on.
+static slab_t *slab_of(void *ptr, u8 tag) {
+    return (slab_t *)PGROUND((uintptr_t)ptr - (tag - 1) * PGSZ);
+}
+
+static void *small_alloc(class_t *c) {
+    void *obj = NULL;
+
+    spin_lock(&c->lock);
+    slab_t *s = c->partial;
+    if (!s) {
+        if ((s = c->empty))
+            c->empty = NULL;
+        else if (!(s = slab_new(c)))
+            goto out;
+        slab_link(c, s);
+    }
+
+    if (s->free) {
+        obj     = s->free;
+        s->free = *(void **)obj;
+    } else {
+        obj = (u8 *)s + SLAB_HDR + (usize)--s->nbump * c->size;
+    }
+
+    if (--s->nfree == 0)
+        slab_unlink(c, s);
+out:
+    spin_unlock(&c->lock);
+    return obj;
+}
+
+static void small_free(slab_t *s, void *obj) {
+    class_t *c = &classes[s->cls];
+
+    spin_lock(&c->lock);
+    *(void **)obj = s->free;
+    s->free = obj;
+
+    if (s->nfree++ == 0)
+        slab_link(c, s);
+
+    if (s->nfree == c->nobj) {
+        slab_unlink(c, s);
+        if (c->empty)
+            slab_destroy(c, s);
+        else
+            c->empty = s;
+    }
+    spin_unlock(&c->lock);
+}
+
+// Buddy blocks are naturally aligned, alignment is only a matter of order.
+static void *large_alloc(usize size, usize align, int zero) {
+    if (size > heap->memsize || align > heap->memsize)
+        return NULL;
+
+    u32 order = size_order(size > align ? size : align);
+    if (order >= heap->norder)
+        return NULL;
+
+    // Only the pages dirtied since they were last zeroed get cleared.
+    void *ptr = zero ? buddy_zalloc(PGSZ << order) : buddy_zone_alloc(heap, PGSZ << order);
+    if (!ptr) return NULL;
+
+    pagemap[page_index(ptr)] = PAGE_LARGE | order;
+    return ptr;
+}
+
+// Smallest class of at least 'size' bytes whose objects are 'align' aligned.
+static int small_class(usize size, usize align) {
+    if (size > SMALL_MAX || align > SLAB_HDR)
+        return -1;
+
+    usize i = class_index[(size + 15) / 16];
+    while (i < NCLASS && class_size[i] % align)
+        i++;
+    return i < NCLASS ? (int)i : -1;
+}
+
+static void *heap_alloc(usize size, usize align, int zero) {
+    int err = heap_init();
+    if (err == -EAGAIN)
+        return boot_alloc(size, align);
+    if (err)
+        return NULL;
+
+    // Before any class lock, setting a ring up may come back into malloc().
+    buddy_trace_attach();
+
+    int cls = small_class(size, align);
+    if (cls < 0)
+        return large_alloc(size, align, zero);
+
+    void *ptr = small_alloc(&classes[cls]);
+    if (ptr && zero)
+        memset(ptr, 0, classes[cls].size);
+    return ptr;
+}
+
+static void heap_free(void *ptr) {
+    if (!ptr || boot_owns(ptr))
+        return;
+    buddy_trace_attach();
+
+    assert(heap && zone_off(heap, ptr) < heap->memsize, "free(): invalid pointer");
+
+    usize pg = page_index(ptr);
+    u8 tag   = pagemap[pg];
+    assert(tag, "free(): invalid pointer");
+
+    if (tag & PAGE_LARGE) {
+        // Untag first, the block may be handed out again as soon as it is freed.
+        pagemap[pg] = 0;
+        buddy_zone_free_sized(heap, ptr, PGSZ << (tag & ~PAGE_LARGE));
+    } else {
+        small_free(slab_of(ptr, tag), ptr);
+    }
+}
+
+static usize heap_usable(void *ptr) {
+    if (!ptr) return 0;
+    if (boot_owns(ptr))
+        return ((usize *)ptr)[-1];
+
+    u8 tag = pagemap[page_index(ptr)];
+    if (tag & PAGE_LARGE)
+        return PGSZ << (tag & ~PAGE_LARGE);
+    return classes[slab_of(ptr, tag)->cls].size;
+}
+
+// What heap_alloc(size, 16) would hand out.
+static usize heap_goodsize(usize size) {
+    int cls = small_class(size, 16);
+    return cls < 0 ? PGSZ << size_order(size) : class_size[cls];
+}
+
+static void *set_errno(void *ptr) {
+    if (!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    return set_errno(heap_alloc(size, 16, 0));
+}
+
+void free(void *ptr) {
+    heap_free(ptr);
+}
+
+void *calloc(size_t n, size_t size) {
+    usize total = 0;
+    if (__builtin_mul_overflow(n, size, &total))
+        return set_errno(NULL);
+    return set_errno(heap_alloc(total, 16, 1));
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ptr)
+        return malloc(size);
+    if (!size) {
+        heap_free(ptr);
+        return NULL;
+    }
+
+    usize old = heap_usable(ptr);
+    if (!boot_owns(ptr) && size <= heap->memsize && heap_goodsize(size) == old)
+        return ptr;
+
+    void *new = heap_alloc(size, 16, 0);
+    if (!new)
+        return set_errno(NULL);
+
+    memcpy(new, ptr, old < size ? old : size);
+    heap_free(ptr);
+    return new;
+}
+
+void *reallocarray(void *ptr, size_t n, size_t size) {
+    usize total = 0;
+    if (__builtin_mul_overflow(n, size, &total))
+        return set_errno(NULL);
+    return realloc(ptr, total);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (!align || (align & (align - 1)) || align % sizeof(void *))
+        return EINVAL;
+
+    void *ptr = heap_alloc(size, align, 0);
+    if (!ptr) return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    if (!align || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return set_errno(heap_alloc(size, align, 0));
+}
+
+void *memalign(size_t align, size_t size) {
+    return aligned_alloc(align, size);
+}
+
+void *valloc(size_t size) {
+    return set_errno(heap_alloc(size, PGSZ, 0));
+}
+
+void *pvalloc(size_t size) {
+    return set_errno(heap_alloc(size ? PGROUNDUP(size) : PGSZ, PGSZ, 0));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return heap_usable(ptr);
+}
@@ -1,23 +1,32 @@
 #include "include/buddy.h"
+#include "include/refill.h"
+#include "include/scavenge.h"
+#include "include/shrink.h"
 #include "include/spinlock.h"
+#include "include/trace.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-// Static variables for memory pool, free list, and used list
-static usize   memsize = 0;
-static buddy_t *pool = NULL;
-static buddy_t *free_list[BUDDY_NORDER] = {NULL};
-static buddy_t *used_list[BUDDY_NORDER] = {NULL};
+// The zone currently backing buddy_alloc()/buddy_free().
+static buddy_zone_t *zone = NULL;
 
 // Helper macros for readability
 #define ALIGN_UP(x, align) (((x) + ((align)-1)) & ~((align)-1))
 
+// Size in bytes of a block of the given order.
+#define order_size(o)       (PGSZ << (o))
+
 // Utility function to dump information about a buddy block
 void dump_buddy(buddy_t *block) {
     assert(block, "No buddy block\n");
-    printf("block: %p, addr: %16p, order: %2ld, next: %p, state: %ld\n",
-           block, (void *)block->addr, block->order, block->next, block->state);
+    printf("block: %p, addr: %16p, order: %2ld, next: %ld, state: %ld\n",
+           block, (void *)block->addr, block->order, (long)block->next, block->state);
 }
 
 // Get the order of a block size (log2 of size/PGSZ)
@@ -31,120 +40,151 @@ static int get_order(usize size) {
     return order;
 }
 
+/**
+ * Both backends implement the same operations on arena offsets:
+ *
+ *  take_free()  take a free block of an order, splitting a larger one if
+ *               needed.
+ *  get_free()   take_free() and mark the block used.
+ *  find_used()  unmark the used block at an address, returning its order.
+ *  merge_free() merge a block with its free buddies and mark the result free,
+ *               updating the order to that of the result.
+ *  put_top()    mark a block free as is, without merging.
+ *  coalesce()   merge the free buddies of an order that put_top() kept
+ *               apart, returning the number of merges.
+ *
+ * Callers hold the zone lock.
+ */
+
+static void chunk_idle(buddy_zone_t *z, u64 addr, u64 order);
+
+// Only the current zone is traced, offsets in other zones would collide.
+#define zone_trace(z, op, order, addr) ({                             \
+    if ((z) == zone)                                                  \
+        buddy_trace((op), (order), (addr));                           \
+})
+
+#ifndef BUDDY_BITMAP
+
+// Descriptor <-> index conversion, BUDDY_NIL maps to NULL.
+#define zone_desc(z, i)     ({ u64 __i = (i); __i == BUDDY_NIL ? NULL : &(z)->desc[__i]; })
+#define zone_index(z, b)    ({ buddy_t *__b = (b); __b ? (u64)(__b - (z)->desc) : BUDDY_NIL; })
+
+// Per-page descriptor index of the used block starting on that page, it
+// follows the descriptors and is only trusted once the descriptor agrees.
+#define zone_pages(z)       ({ (u64 *)&(z)->desc[(z)->ndesc]; })
+
 // Initialize a buddy block to the FREE state
 static void block_init(buddy_t *block) {
     if (!block) return;
 
     block->addr     = 0x0;  // Reset the address to a known value (you may want to initialize this elsewhere)
     block->order    = 0;    // Reset the order
-    block->next     = NULL;
-    block->pages    = NULL;
-    block->bitmap   = NULL;
+    block->next     = BUDDY_NIL;
     block->state    = BUDDY_FREE;
 }
 
-
 // Get a block from the pool of available blocks
-static int get_pool(buddy_t **ref) {
+static int get_pool(buddy_zone_t *z, buddy_t **ref) {
     if (!ref) return -EINVAL;
 
-    buddy_t *block = pool;
+    buddy_t *block = zone_desc(z, z->pool);
     if (block) {
-        pool = block->next;
-        block_init(block);
-        *ref = block;
-        return 0;
+        z->pool = block->next;
+    } else if (z->bump < z->ndesc) {
+        // Descriptors past 'bump' were never used, hand them out in order.
+        block = &z->desc[z->bump++];
+    } else {
+        return -ENOMEM;
     }
-    return -ENOMEM;
+
+    block_init(block);
+    *ref = block;
+    return 0;
 }
 
 // Return a block back to the pool
-static int put_pool(buddy_t *block) {
+static int put_pool(buddy_zone_t *z, buddy_t *block) {
     if (!block) return -EINVAL;
-    block->next = pool;
-    pool = block;
+    block->next = z->pool;
+    z->pool = zone_index(z, block);
     return 0;
 }
 
-static int put_list(buddy_t **list, buddy_t *block) {
+static int put_list(buddy_zone_t *z, u64 *list, buddy_t *block) {
     if (!list || !block)
         return -EINVAL;
     block->next = list[block->order];
-    list[block->order] = block;
+    list[block->order] = zone_index(z, block);
     return 0;
 }
 
 // Add a block to the free list
-static int put_free(buddy_t *block) {
-    return put_list(free_list, block);
+static int put_free(buddy_zone_t *z, buddy_t *block) {
+    int err = put_list(z, z->free_list, block);
+    if (err == 0) z->nfree[block->order]++;
+    return err;
 }
 
-// Add a block to the used list
-static int put_used(buddy_t *block) {
-    return put_list(used_list, block);
+// Mark a block used and index it by its first page
+static int put_used(buddy_zone_t *z, buddy_t *block) {
+    if (!block) return -EINVAL;
+    block->state = BUDDY_FULL;
+    block->next  = BUDDY_NIL;
+    zone_pages(z)[block->addr / PGSZ] = zone_index(z, block);
+    z->nused[block->order]++;
+    return 0;
 }
 
-// Find and remove a block from the used list by its address
-static int find_used(uintptr_t addr, buddy_t **ref) {
-    if (!ref) return -EINVAL;
-    
-    for (int i = 0; i < BUDDY_NORDER; ++i) {
-        buddy_t *block = used_list[i];
-        buddy_t *prev  = NULL;
+// Find and unmark the used block at an address through the page index,
+// 'hint' is not needed here. Entries are never cleared, a stale one points
+// at a descriptor that was recycled, never handed out or is not FULL there.
+static int find_used(buddy_zone_t *z, u64 addr, int hint __unused, u64 *order) {
+    if (!order || addr % PGSZ || addr >= z->memsize) return -EINVAL;
 
-        while (block) {
-            if (block->addr == addr) {
-                if (prev) {
-                    prev->next = block->next;
-                } else {
-                    used_list[i] = block->next;
-                }
-                block->next = NULL;
-                *ref = block;
-                return 0;
-            }
-            prev = block;
-            block = block->next;
-        }
-    }
-    return -ENOENT;
+    u64 i = zone_pages(z)[addr / PGSZ];
+    if (i >= z->bump) return -ENOENT;
+
+    buddy_t *block = &z->desc[i];
+    if (block->state != BUDDY_FULL || block->addr != addr)
+        return -ENOENT;
+
+    // Pooled descriptors must never look used to a stale entry.
+    block->state = BUDDY_FREE;
+    z->nused[block->order]--;
+    *order = block->order;
+    return put_pool(z, block);
 }
 
 // Split a block into two buddies of the next lower order
-static int split_block(buddy_t *block) {
+static int split_block(buddy_zone_t *z, buddy_t *block) {
     if (!block) return -EINVAL;
 
     // Ensure block order is within valid range
-    if (block->order <= 0 || block->order >= BUDDY_NORDER) {
+    if (block->order <= 0 || block->order >= z->norder) {
         printf("split_block: Invalid order %ld\n", block->order);
         return -EINVAL;
     }
 
     buddy_t *buddy = NULL;
-    int err = get_pool(&buddy);
+    int err = get_pool(z, &buddy);
     if (err) return err;
 
     // Reduce the order of the current block
     block->order -= 1;
 
     // Initialize the buddy block with the next order
-    buddy->next     = NULL;
+    buddy->next     = BUDDY_NIL;
     buddy->state    = BUDDY_FREE;
     buddy->order    = block->order;
     buddy->addr     = block->addr + buddy_size(block);  // Adjust the address for the buddy
 
     // Insert buddy into free list
-    err = put_free(buddy);
-    if (err) return err;
-
-    // printf("split_block: Split block into addr %p and buddy addr %p at order %ld\n", 
-        //    (void *)block->addr, (void *)buddy->addr, block->order);
-
-    return 0;
+    return put_free(z, buddy);
 }
 
-// Get a free block of a specific order
-static int get_free(int order, buddy_t **ref) {
+// Take a block of a specific order off the free lists, splitting if needed
+static int take_block(buddy_zone_t *z, int order, buddy_t **ref) {
     buddy_t *block = NULL;
 
     if (order >= BUDDY_NORDER || !ref) {
@@ -153,66 +193,66 @@ static int get_free(int order, buddy_t **ref) {
     }
 
     // Search for a block in the free list of the required order
-    // printf("get_free: Searching for free block of order %d\n", order);
-    for (int i = order; i < BUDDY_NORDER; ++i) {
-        block = free_list[i];
+    for (u64 i = order; i < z->norder; ++i) {
+        block = zone_desc(z, z->free_list[i]);
 
         // Check if a block was found in the free list at the current order level
         if (block) {
-            // printf("get_free: Found block at order %ld (expected order %d)\n", block->order, order);
-            // dump_buddy(block);
-
             // Remove block from the free list
-            free_list[i] = block->next;
-            // printf("get_free: Removed block from free list at order %d\n", i);
-            block->next = NULL;
+            z->free_list[i] = block->next;
+            z->nfree[i]--;
+            block->next = BUDDY_NIL;
 
             // Split the block if needed to reach the required order
             while (block->order > (u32)order) {
-                // printf("get_free: Splitting block of order %ld\n", block->order);
-                int err = split_block(block);
+                int err = split_block(z, block);
                 if (err) {
-                    // printf("get_free: Error splitting block: %d\n", err);
+                    put_free(z, block);
                     return err;
                 }
-                // dump_buddy(block);  // Dump the block state after splitting
             }
 
-            // Prepare the block for use
-            block->state = BUDDY_FULL;
             *ref = block;
-
-            // printf("get_free: Allocated block %p with order %ld\n", (void *)block->addr, block->order);
-            return put_used(block);
+            return 0;
         }
     }
 
     // If no block was found, return error
-    // printf("get_free: No free block available for order %d\n", order);
     return -ENOMEM;
 }
 
+// Get a free block of a specific order
+static int get_free(buddy_zone_t *z, int order, u64 *ref) {
+    buddy_t *block = NULL;
+    int err = take_block(z, order, &block);
+    if (err) return err;
 
-// Allocate memory using buddy system
-void *buddy_alloc(usize size) {
+    *ref = block->addr;
+    return put_used(z, block);
+}
+
+// Take a free block of a specific order without marking it used
+static int take_free(buddy_zone_t *z, int order, u64 *ref) {
     buddy_t *block = NULL;
-    int err = get_free(get_order(size), &block);
-    if (err) return NULL;
-    return (block ? (void *)block->addr : NULL);
+    int err = take_block(z, order, &block);
+    if (err) return err;
+
+    *ref = block->addr;
+    return put_pool(z, block);
 }
 
-// Free a block and merge with its buddy if possible
-void buddy_free(void *ptr) {
+// Merge a block with its buddies and add the result to the free list
+static int merge_free(buddy_zone_t *z, u64 addr, u64 *order) {
     buddy_t *block = NULL;
-    int err = find_used((uintptr_t)ptr, &block);
-    if (err) {
-        panic("Failed to find the block at %p\n", ptr);
-        return;
-    }
+    int err = get_pool(z, &block);
+    if (err) return err;
+
+    block->addr  = addr;
+    block->order = *order;
 
     // Try to find the buddy and merge if possible
-    while (block->order < BUDDY_NORDER - 1) {
-        buddy_t *buddy = free_list[block->order];
+    while (block->order < z->norder - 1) {
+        buddy_t *buddy = zone_desc(z, z->free_list[block->order]);
         buddy_t *prev_buddy = NULL;
 
         while (buddy) {
@@ -228,74 +268,1073 @@ void buddy_free(void *ptr) {
                 if (prev_buddy) {
                     prev_buddy->next = buddy->next;
                 } else {
-                    free_list[block->order - 1] = buddy->next;
+                    z->free_list[block->order - 1] = buddy->next;
                 }
+                z->nfree[block->order - 1]--;
 
                 // Return buddy to the pool
-                put_pool(buddy);
-                
-                // Continue checking for more buddies
-                buddy = free_list[block->order];
-                prev_buddy = NULL;
-                continue;
+                put_pool(z, buddy);
+                break;
             }
-
             prev_buddy = buddy;
-            buddy = buddy->next;
+            buddy = zone_desc(z, buddy->next);
         }
-        break;
+
+        // No buddy at this order, stop merging.
+        if (!buddy) break;
     }
 
     // Mark the block as free and reinsert it into the free list
     block->state = BUDDY_FREE;
-    put_free(block);
+    *order = block->order;
+    return put_free(z, block);
 }
 
-void dump_free_list() {
-    for (int i = 0; i < BUDDY_NORDER; ++i) {
-        printf("Free list order %d:\n", i);
-        buddy_t *block = free_list[i];
+// Transient states of the blocks coalesce() detached from a free list.
+#define BUDDY_PAIRING   (BUDDY_FULL + 1)    // not looked at yet.
+#define BUDDY_LOWER     (BUDDY_FULL + 2)    // lower half of a pair, becomes the merged block.
+#define BUDDY_UPPER     (BUDDY_FULL + 3)    // upper half of a pair, goes back to the pool.
+
+/**
+ * Linear in the length of the list: every block is first indexed by its
+ * page in the page index, which only trusts FULL descriptors, so a block
+ * finds its buddy with a single lookup. Blocks are only relinked once all
+ * pairs are known, as relinking overwrites the 'next' being walked.
+ */
+static u64 coalesce(buddy_zone_t *z, u64 order) {
+    buddy_t *head = zone_desc(z, z->free_list[order]);
+    buddy_t *next = NULL;
+    u64 *pages    = zone_pages(z);
+    u64 nmerge    = 0;
+
+    z->free_list[order] = BUDDY_NIL;
+    z->nfree[order]     = 0;
+
+    forlinked(b, head, zone_desc(z, b->next)) {
+        b->state = BUDDY_PAIRING;
+        pages[b->addr / PGSZ] = zone_index(z, b);
+    }
+
+    forlinked(b, head, zone_desc(z, b->next)) {
+        if (b->state != BUDDY_PAIRING)
+            continue;
+
+        u64 addr = b->addr ^ order_size(order);
+        u64 i    = addr < z->memsize ? pages[addr / PGSZ] : BUDDY_NIL;
+        buddy_t *buddy = i < z->bump ? &z->desc[i] : NULL;
+
+        if (buddy && buddy->state == BUDDY_PAIRING && buddy->addr == addr &&
+            buddy->order == order) {
+            b->state     = b->addr < addr ? BUDDY_LOWER : BUDDY_UPPER;
+            buddy->state = b->addr < addr ? BUDDY_UPPER : BUDDY_LOWER;
+        } else {
+            b->state = BUDDY_FREE;
+        }
+    }
+
+    forlinked(b, head, next) {
+        next = zone_desc(z, b->next);
+
+        if (b->state == BUDDY_UPPER) {
+            b->state = BUDDY_FREE;
+            put_pool(z, b);
+            continue;
+        }
+        if (b->state == BUDDY_LOWER) {
+            b->state = BUDDY_FREE;
+            b->order++;
+            nmerge++;
+        }
+        put_free(z, b);
+        if (b->order > order)
+            chunk_idle(z, b->addr, b->order);
+    }
+    return nmerge;
+}
+
+static void dump_list(buddy_zone_t *z, u64 *list, const char *name) {
+    for (u64 i = 0; i < z->norder; ++i) {
+        printf("%s list order %ld:\n", name, i);
+        buddy_t *block = zone_desc(z, list[i]);
         while (block) {
             dump_buddy(block);
-            block = block->next;
+            block = zone_desc(z, block->next);
         }
     }
 }
 
+void dump_free_list() {
+    if (zone) dump_list(zone, zone->free_list, "Free");
+}
+
 void dump_used_list() {
-    for (int i = 0; i < BUDDY_NORDER; ++i) {
-        printf("Used list order %d:\n", i);
-        buddy_t *block = used_list[i];
-        while (block) {
-            dump_buddy(block);
-            block = block->next;
+    if (!zone) return;
+    printf("Used blocks:\n");
+    for (u64 i = 0; i < zone->bump; ++i) {
+        if (zone->desc[i].state == BUDDY_FULL)
+            dump_buddy(&zone->desc[i]);
+    }
+}
+
+// Descriptors for the worst case of every page being its own block, and
+// the page index of used blocks.
+static usize zone_metasize(usize memsize) {
+    return NPAGE(memsize) * (sizeof(buddy_t) + sizeof(u64));
+}
+
+// Reset the metadata to an empty arena, 'pool' and 'bump' make this O(1).
+static void zone_clear(buddy_zone_t *z) {
+    z->ndesc    = NPAGE(z->memsize);
+    z->pool     = BUDDY_NIL;
+    z->bump     = 0;
+
+    for (int i = 0; i < BUDDY_NORDER; ++i)
+        z->free_list[i] = BUDDY_NIL;
+}
+
+// Add a block to the free list without trying to merge it.
+static int put_top(buddy_zone_t *z, u64 addr, u64 order) {
+    buddy_t *block = NULL;
+    int err = get_pool(z, &block);
+    if (err) return err;
+
+    block->addr  = addr;
+    block->order = order;
+    return put_free(z, block);
+}
+
+#else // BUDDY_BITMAP
+
+#define zone_words(z)       ({ (u64 *)((uintptr_t)(z) + (z)->words); })
+
+#define BITS                64
+#define word_of(b)          ((b) / BITS)
+#define bit_of(b)           (1ull << ((b) % BITS))
+
+// Set a block's bit, marking the path up the tree as non-empty.
+static void map_set(buddy_zone_t *z, u64 order, u64 bit) {
+    buddy_map_t *map = &z->map[order];
+    u64 *words = zone_words(z);
+
+    for (u64 l = 0; l < map->nlevel; ++l, bit /= BITS) {
+        u64 *w = &words[map->level[l] + word_of(bit)];
+        u64 old = *w;
+        *w |= bit_of(bit);
+        if (old) break; // The parent already has this word marked.
+    }
+}
+
+// Clear a block's bit, clearing summary bits of words that became empty.
+static void map_clear(buddy_zone_t *z, u64 order, u64 bit) {
+    buddy_map_t *map = &z->map[order];
+    u64 *words = zone_words(z);
+
+    for (u64 l = 0; l < map->nlevel; ++l, bit /= BITS) {
+        u64 *w = &words[map->level[l] + word_of(bit)];
+        *w &= ~bit_of(bit);
+        if (*w) break;
+    }
+}
+
+static int map_test(buddy_zone_t *z, u64 off, u64 bit) {
+    return (zone_words(z)[off + word_of(bit)] & bit_of(bit)) != 0;
+}
+
+// Walk down from the single top word to the first free block of an order.
+static int map_find(buddy_zone_t *z, u64 order, u64 *bit) {
+    buddy_map_t *map = &z->map[order];
+    u64 *words = zone_words(z);
+    u64 i = 0;
+
+    for (u64 l = map->nlevel; l-- > 0;) {
+        u64 w = words[map->level[l] + i];
+        if (!w) return -ENOMEM;
+        i = i * BITS + __builtin_ctzll(w);
+    }
+
+    *bit = i;
+    return 0;
+}
+
+// Take a free block of a specific order, splitting a larger one if needed
+static int take_free(buddy_zone_t *z, int order, u64 *ref) {
+    if (order >= BUDDY_NORDER || !ref) {
+        printf("get_free: Invalid order %d or null reference\n", order);
+        return -EINVAL;
+    }
+
+    for (u64 i = order; i < z->norder; ++i) {
+        u64 bit = 0;
+        if (map_find(z, i, &bit))
+            continue;
+
+        map_clear(z, i, bit);
+        z->nfree[i]--;
+
+        // Split down to 'order', the upper half of every split stays free.
+        while (i > (u64)order) {
+            i--;
+            bit *= 2;
+            map_set(z, i, bit + 1);
+            z->nfree[i]++;
+        }
+
+        *ref = bit * order_size(order);
+        return 0;
+    }
+
+    return -ENOMEM;
+}
+
+// Get a free block of a specific order
+static int get_free(buddy_zone_t *z, int order, u64 *ref) {
+    int err = take_free(z, order, ref);
+    if (err) return err;
+
+    u64 bit = *ref / order_size(order);
+    zone_words(z)[z->map[order].used + word_of(bit)] |= bit_of(bit);
+    z->nused[order]++;
+    return 0;
+}
+
+// Find and unmark a used block by its address, 'hint' as in the list backend
+static int find_used(buddy_zone_t *z, u64 addr, int hint, u64 *order) {
+    if (!order) return -EINVAL;
+
+    // A block is aligned to its size, so stop at the first order it is not.
+    u64 end = (hint < 0 || (u64)hint >= z->norder) ? z->norder : (u64)hint + 1;
+    for (u64 i = hint < 0 ? 0 : hint; i < end && !(addr % order_size(i)); ++i) {
+        u64 bit = addr / order_size(i);
+        if (bit >= z->map[i].nbit || !map_test(z, z->map[i].used, bit))
+            continue;
+
+        zone_words(z)[z->map[i].used + word_of(bit)] &= ~bit_of(bit);
+        z->nused[i]--;
+        *order = i;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+// Merge a block with its buddies and mark the result free
+static int merge_free(buddy_zone_t *z, u64 addr, u64 *order) {
+    u64 o   = *order;
+    u64 bit = addr / order_size(o);
+
+    while (o < z->norder - 1) {
+        u64 buddy = bit ^ 1;
+        if (buddy >= z->map[o].nbit || !map_test(z, z->map[o].level[0], buddy))
+            break;
+
+        map_clear(z, o, buddy);
+        z->nfree[o]--;
+        bit /= 2;
+        o++;
+    }
+
+    map_set(z, o, bit);
+    z->nfree[o]++;
+    *order = o;
+    return 0;
+}
+
+static u64 coalesce(buddy_zone_t *z, u64 order) {
+    buddy_map_t *map = &z->map[order];
+    u64 *words = zone_words(z);
+    u64 nmerge = 0;
+
+    for (u64 i = 0; i * BITS < map->nbit; ++i) {
+        // Even bits whose odd buddy is also free.
+        u64 pairs = words[map->level[0] + i] & (words[map->level[0] + i] >> 1) &
+                    0x5555555555555555ull;
+
+        for (; pairs; pairs &= pairs - 1) {
+            u64 bit = i * BITS + __builtin_ctzll(pairs);
+            map_clear(z, order, bit);
+            map_clear(z, order, bit + 1);
+            z->nfree[order] -= 2;
+
+            map_set(z, order + 1, bit / 2);
+            z->nfree[order + 1]++;
+            chunk_idle(z, bit * order_size(order), order + 1);
+            nmerge++;
+        }
+    }
+    return nmerge;
+}
+
+static void dump_map(buddy_zone_t *z, int used, const char *name) {
+    for (u64 i = 0; i < z->norder; ++i) {
+        buddy_map_t *map = &z->map[i];
+        u64 off = used ? map->used : map->level[0];
+
+        printf("%s map order %ld:\n", name, i);
+        for (u64 bit = 0; bit < map->nbit; ++bit) {
+            if (map_test(z, off, bit))
+                printf("addr: %16p, order: %2ld\n", (void *)(bit * order_size(i)), i);
+        }
+    }
+}
+
+void dump_free_list() {
+    if (zone) dump_map(zone, 0, "Free");
+}
+
+void dump_used_list() {
+    if (zone) dump_map(zone, 1, "Used");
+}
+
+// Lay out every order's trees, returning the number of words they take.
+static u64 map_layout(buddy_map_t *maps, usize memsize) {
+    u64 norder = get_order(memsize) + 1;
+    u64 nword  = 0;
+
+    for (u64 i = 0; i < norder; ++i) {
+        buddy_map_t map = { .nbit = NPAGE(memsize) >> i };
+        u64 n = map.nbit;
+
+        do {
+            n = MAX(1, (n + BITS - 1) / BITS);
+            map.level[map.nlevel++] = nword;
+            nword += n;
+        } while (n > 1);
+
+        map.used = nword;
+        nword += MAX(1, (map.nbit + BITS - 1) / BITS);
+
+        if (maps) maps[i] = map;
+    }
+    return nword;
+}
+
+static usize zone_metasize(usize memsize) {
+    return map_layout(NULL, memsize) * sizeof(u64);
+}
+
+// Reset the bitmaps to an empty arena.
+static void zone_clear(buddy_zone_t *z) {
+    z->ndesc = 0;
+    z->words = sizeof *z;
+    memset(zone_words(z), 0, map_layout(z->map, z->memsize) * sizeof(u64));
+}
+
+// Mark a block free without trying to merge it.
+static int put_top(buddy_zone_t *z, u64 addr, u64 order) {
+    map_set(z, order, addr / order_size(order));
+    z->nfree[order]++;
+    return 0;
+}
+
+#endif // BUDDY_BITMAP
+
+/**
+ * Known-zero tracking. Every page has a dirty bit, a clear bit means the
+ * page still reads as zero. Bits are set when a block is freed, a block
+ * is known zero when all of its pages are, so the state survives splits
+ * and merges AND it for free. Fresh mappings start out all clean.
+ */
+
+#define zone_dirty(z)       ({ (u64 *)((uintptr_t)(z) + (z)->dirty); })
+
+static usize zone_dirtysize(usize memsize) {
+    return ALIGN_UP(NPAGE(memsize), 64) / 8;
+}
+
+// Mark the pages of a block dirty, caller holds the zone lock.
+static void dirty_mark(buddy_zone_t *z, u64 addr, u64 order) {
+    u64 *w    = zone_dirty(z);
+    u64 first = addr / PGSZ;
+    u64 npage = 1ull << order;
+
+    // Blocks are aligned to their size, so a small block sits inside one
+    // word that other blocks share, and a large one covers whole words.
+    if (npage < 64)
+        __atomic_fetch_or(&w[first / 64], ((1ull << npage) - 1) << (first % 64), __ATOMIC_RELAXED);
+    else
+        memset(&w[first / 64], 0xff, npage / 8);
+}
+
+// Zero the dirty pages of a block we own, coalescing runs into one memset.
+static void zero_block(buddy_zone_t *z, u64 addr, u64 order) {
+    u64 *w    = zone_dirty(z);
+    u64 first = addr / PGSZ;
+    u64 end   = first + (1ull << order);
+    u64 run   = end;
+
+    for (u64 p = first; p < end; ++p) {
+        u64 word = __atomic_load_n(&w[p / 64], __ATOMIC_RELAXED);
+
+        // Skip whole clean words.
+        if (!word && p % 64 == 0 && run == end) {
+            p += 63;
+            continue;
+        }
+
+        if (word & (1ull << (p % 64))) {
+            if (run == end) run = p;
+        } else if (run != end) {
+            memset(zone_ptr(z, run * PGSZ), 0, (p - run) * PGSZ);
+            run = end;
+        }
+    }
+
+    if (run != end)
+        memset(zone_ptr(z, run * PGSZ), 0, (end - run) * PGSZ);
+}
+
+/**
+ * Idle tracking for the scavenger. The arena is cut into chunks of
+ * BUDDY_CHUNK_ORDER, blocks being naturally aligned a chunk is either
+ * inside one block or made of whole blocks. Each chunk has a stamp, 0
+ * while any part of it is allocated, else the time in ms it became wholly
+ * free, with CHUNK_RECLAIMED set once its pages were given back to the OS.
+ */
+
+#define zone_chunks(z)      ({ (u64 *)((uintptr_t)(z) + (z)->chunks); })
+#define CHUNK_SIZE          order_size(BUDDY_CHUNK_ORDER)
+#define CHUNK_RECLAIMED     (1ull << 63)
+
+static usize zone_chunksize(usize memsize) {
+    return (memsize / CHUNK_SIZE) * sizeof(u64);
+}
+
+static u64 now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    // Never 0, that is the stamp of a busy chunk.
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+// A block was taken for use, the chunks it touches are busy again.
+static void chunk_busy(buddy_zone_t *z, u64 addr, u64 order) {
+    u64 *c   = zone_chunks(z);
+    u64 end  = (addr + order_size(order) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    for (u64 i = addr / CHUNK_SIZE; i < end && i < z->nchunk; ++i) {
+        if (c[i] & CHUNK_RECLAIMED)
+            z->nreclaimed--;
+        c[i] = 0;
+    }
+}
+
+// A free block was formed, the chunks that just became wholly free start idling.
+static void chunk_idle(buddy_zone_t *z, u64 addr, u64 order) {
+    u64 *c  = zone_chunks(z);
+    u64 end = (addr + order_size(order)) / CHUNK_SIZE;
+    u64 now = 0;
+
+    if (order < BUDDY_CHUNK_ORDER)
+        return;
+
+    // Chunks that were free already keep their stamp.
+    for (u64 i = addr / CHUNK_SIZE; i < end && i < z->nchunk; ++i) {
+        if (!c[i])
+            c[i] = now ? now : (now = now_ms());
+    }
+}
+
+// Allocate a block of 'order', taking the zone lock.
+static int zone_alloc(buddy_zone_t *z, int order, u64 *ref) {
+    u64 addr = 0;
+
+    buddy_trace_attach();
+    spin_lock(&z->lock);
+    int err = get_free(z, order, &addr);
+    if (err) {
+        spin_unlock(&z->lock);
+
+        // Let the shrinkers drain what they hold into the zone and retry once.
+        if (err != -ENOMEM || z != zone || buddy_shrink(order) == 0) {
+            zone_trace(z, BUDDY_EV_NOMEM, order, BUDDY_NIL);
+            buddy_trace_flush();
+            return err;
+        }
+
+        spin_lock(&z->lock);
+        if ((err = get_free(z, order, &addr))) {
+            zone_trace(z, BUDDY_EV_NOMEM, order, BUDDY_NIL);
+            spin_unlock(&z->lock);
+            buddy_trace_flush();
+            return err;
+        }
+    }
+
+    // Traced under the lock so event order matches allocator order.
+    zone_trace(z, BUDDY_EV_ALLOC, order, addr);
+    chunk_busy(z, addr, order);
+    int low = z->nfree[order] < z->wmark_low[order];
+    spin_unlock(&z->lock);
+
+    buddy_trace_flush();
+    if (low) buddy_refill_kick();
+
+    *ref = addr;
+    return 0;
+}
+
+// The zone buddy_alloc()/buddy_free() work on.
+buddy_zone_t *buddy_zone(void) {
+    return zone;
+}
+
+// Allocate memory from zone 'z', NULL selects the current zone.
+void *buddy_zone_alloc(buddy_zone_t *z, usize size) {
+    u64 addr = 0;
+
+    if (!z) z = zone;
+    // Also keeps get_order() from rounding a huge size around to zero.
+    if (!z || size > z->memsize || zone_alloc(z, get_order(size), &addr))
+        return NULL;
+    return zone_ptr(z, addr);
+}
+
+// Allocate memory using buddy system
+void *buddy_alloc(usize size) {
+    return buddy_zone_alloc(zone, size);
+}
+
+// Allocate zeroed memory, only pages that were dirtied get cleared.
+void *buddy_zalloc(usize size) {
+    buddy_zone_t *z = zone;
+    int order = get_order(size);
+    u64 addr  = 0;
+
+    if (!z || size > z->memsize || zone_alloc(z, order, &addr))
+        return NULL;
+
+    // The block is ours, no one else touches its dirty bits until it is freed.
+    zero_block(z, addr, order);
+    return zone_ptr(z, addr);
+}
+
+// Free a block and merge with its buddy if possible, caller holds the zone lock.
+static void zone_free(buddy_zone_t *z, void *ptr, int hint) {
+    u64 addr  = zone_off(z, ptr);
+    u64 order = 0;
+
+    int err = find_used(z, addr, hint, &order);
+    if (err) {
+        panic("Failed to find the block at %p\n", ptr);
+        return;
+    }
+
+    zone_trace(z, BUDDY_EV_FREE, order, addr);
+    dirty_mark(z, addr, order);
+
+    if ((err = merge_free(z, addr, &order)))
+        panic("Failed to free the block at %p: %d\n", ptr, err);
+
+    // 'addr' is somewhere inside the merged block.
+    chunk_idle(z, addr & ~(order_size(order) - 1), order);
+}
+
+// Free memory allocated from zone 'z', NULL selects the current zone.
+void buddy_zone_free(buddy_zone_t *z, void *ptr) {
+    if (!z) z = zone;
+
+    assert(z, "buddy allocator not initialized");
+
+    buddy_trace_attach();
+    spin_lock(&z->lock);
+    zone_free(z, ptr, -1);
+    spin_unlock(&z->lock);
+    buddy_trace_flush();
+}
+
+// Free memory whose allocation size is known, only its order is searched.
+void buddy_zone_free_sized(buddy_zone_t *z, void *ptr, usize size) {
+    if (!z) z = zone;
+
+    assert(z, "buddy allocator not initialized");
+
+    buddy_trace_attach();
+    spin_lock(&z->lock);
+    zone_free(z, ptr, get_order(size));
+    spin_unlock(&z->lock);
+    buddy_trace_flush();
+}
+
+void buddy_free(void *ptr) {
+    buddy_zone_free(zone, ptr);
+}
+
+void buddy_free_sized(void *ptr, usize size) {
+    buddy_zone_free_sized(zone, ptr, size);
+}
+
+// Free 'n' blocks under a single acquisition of the zone lock.
+void buddy_free_bulk(void **ptrs, usize n) {
+    buddy_zone_t *z = zone;
+
+    assert(z, "buddy allocator not initialized");
+
+    buddy_trace_attach();
+    spin_lock(&z->lock);
+    for (usize i = 0; i < n; ++i) {
+        if (ptrs[i])
+            zone_free(z, ptrs[i], -1);
+    }
+    spin_unlock(&z->lock);
+    buddy_trace_flush();
+}
+
+// Snapshot the per-order block counts of the current zone.
+int buddy_stats(buddy_stats_t *stats) {
+    if (!stats) return -EINVAL;
+    if (!zone) return -ENOENT;
+
+    memset(stats, 0, sizeof *stats);
+    spin_lock(&zone->lock);
+    stats->memsize = zone->memsize;
+    stats->norder  = zone->norder;
+    stats->maxfree = -1;
+
+    for (u64 i = 0; i < zone->norder; ++i) {
+        stats->nfree[i] = zone->nfree[i];
+        stats->nused[i] = zone->nused[i];
+        stats->free    += zone->nfree[i] * order_size(i);
+        stats->used    += zone->nused[i] * order_size(i);
+        if (zone->nfree[i])
+            stats->maxfree = i;
+    }
+    stats->reclaimed = zone->nreclaimed * CHUNK_SIZE;
+    spin_unlock(&zone->lock);
+    return 0;
+}
+
+// Merge the free buddies the refill kept apart, returns the number of merges.
+int buddy_coalesce(void) {
+    buddy_zone_t *z = zone;
+    u64 nmerge = 0;
+
+    if (!z) return -ENOENT;
+
+    // Bottom-up, so merged blocks get merged again one order up.
+    for (u64 o = 0; o + 1 < z->norder; ++o) {
+        spin_lock(&z->lock);
+        nmerge += coalesce(z, o);
+        spin_unlock(&z->lock);
+    }
+    return nmerge;
+}
+
+// Keep between 'low' and 'high' free blocks of 'order' ready, 0 disables it.
+int buddy_set_watermark(int order, usize low, usize high) {
+    if (!zone) return -ENOENT;
+    if (order < 0 || (u64)order + 1 >= zone->norder || low > high)
+        return -EINVAL;
+
+    spin_lock(&zone->lock);
+    zone->wmark_low[order]  = low;
+    zone->wmark_high[order] = high;
+    spin_unlock(&zone->lock);
+    return 0;
+}
+
+/**
+ * Pre-split larger blocks into every order that fell below its low
+ * watermark, until it is back at its high watermark. Orders are filled
+ * bottom-up, one split per hold of the lock: the smallest larger free
+ * block is split in two and both halves are kept apart, the next round
+ * splits the lower one further. Foreground allocations therefore never
+ * wait for more than one split, even when the orders in between are
+ * empty. An order still below its low watermark once nothing is left to
+ * split gets one round of shrinkers, without coalescing, see shrink.h.
+ * Returns the number of splits.
+ */
+int buddy_refill(void) {
+    buddy_zone_t *z = zone;
+    int nsplit = 0;
+
+    if (!z) return -ENOENT;
+
+    for (u64 o = 0; o + 1 < z->norder; ++o) {
+        if (__atomic_load_n(&z->nfree[o], __ATOMIC_RELAXED) >= z->wmark_low[o])
+            continue;
+
+        int shrunk = 0;
+        loop() {
+            u64 addr = 0;
+            u64 k    = o + 1;
+
+            spin_lock(&z->lock);
+            if (z->nfree[o] >= z->wmark_high[o]) {
+                spin_unlock(&z->lock);
+                break;
+            }
+
+            // An exact-order take, take_free() does not split on its own.
+            while (k < z->norder && !z->nfree[k])
+                k++;
+            if (k == z->norder || take_free(z, k, &addr)) {
+                int low = z->nfree[o] < z->wmark_low[o];
+                spin_unlock(&z->lock);
+
+                if (low && !shrunk++ && buddy_shrink_cost(o + 1, BUDDY_SHRINK_REFILL))
+                    continue;
+                break;
+            }
+            // Both halves stay apart, merging them back is what we avoid.
+            put_top(z, addr, k - 1);
+            put_top(z, addr + order_size(k - 1), k - 1);
+            spin_unlock(&z->lock);
+            nsplit++;
+        }
+    }
+    return nsplit;
+}
+
+#define SCAVENGE_BATCH      64  // oldest chunks picked per pass over the stamps.
+
+typedef struct scavenge_pick_t {
+    u64         stamp;
+    u64         chunk;
+} scavenge_pick_t;
+
+// Collect up to SCAVENGE_BATCH of the oldest chunks idle since 'before', oldest first.
+static int scavenge_pick(buddy_zone_t *z, u64 before, scavenge_pick_t *pick) {
+    int n = 0;
+
+    for (u64 i = 0; i < z->nchunk; ++i) {
+        u64 c = __atomic_load_n(&zone_chunks(z)[i], __ATOMIC_RELAXED);
+        if (!c || (c & CHUNK_RECLAIMED) || c > before)
+            continue;
+        if (n == SCAVENGE_BATCH && c >= pick[n - 1].stamp)
+            continue;
+
+        int j = n < SCAVENGE_BATCH ? n++ : n - 1;
+        for (; j > 0 && pick[j - 1].stamp > c; --j)
+            pick[j] = pick[j - 1];
+        pick[j] = (scavenge_pick_t){ .stamp = c, .chunk = i };
+    }
+    return n;
+}
+
+// Reclaim one picked chunk, 1 if it was, 0 if it changed since, or < 0 to stop.
+static int scavenge_chunk(buddy_zone_t *z, scavenge_pick_t *pick, usize retain, int flags) {
+    u64 *c = &zone_chunks(z)[pick->chunk];
+
+    spin_lock(&z->lock);
+    if (*c != pick->stamp) {
+        spin_unlock(&z->lock);
+        return 0;
+    }
+
+    usize free = 0;
+    for (u64 o = 0; o < z->norder; ++o)
+        free += z->nfree[o] * order_size(o);
+    if (free - z->nreclaimed * CHUNK_SIZE < retain + CHUNK_SIZE) {
+        spin_unlock(&z->lock);
+        return -ENOSPC;
+    }
+
+    void *ptr = zone_ptr(z, pick->chunk * CHUNK_SIZE);
+    int lazy  = (flags & BUDDY_SCAVENGE_LAZY) && !madvise(ptr, CHUNK_SIZE, MADV_FREE);
+    if (!lazy && madvise(ptr, CHUNK_SIZE, MADV_DONTNEED)) {
+        int err = -errno;
+        spin_unlock(&z->lock);
+        return err;
+    }
+
+    if (!lazy && (z->flags & BUDDY_ZONE_ANON))
+        memset(&zone_dirty(z)[pick->chunk * CHUNK_SIZE / PGSZ / 64], 0, CHUNK_SIZE / PGSZ / 8);
+
+    *c |= CHUNK_RECLAIMED;
+    z->nreclaimed++;
+    spin_unlock(&z->lock);
+    return 1;
+}
+
+/**
+ * Give the pages of chunks idle for at least 'delay_ms' back to the OS,
+ * oldest first, as long as more than 'retain' bytes of free memory stay
+ * resident. The delay and the resident cushion keep a chunk that is freed
+ * and reused in bursts from bouncing in and out of the page tables.
+ *
+ * BUDDY_SCAVENGE_LAZY uses MADV_FREE, the kernel only takes the pages
+ * when it needs them. Otherwise MADV_DONTNEED drops them at once and in
+ * an anonymous zone they read as zero afterwards, so their dirty bits are
+ * cleared. Stamps are scanned without the lock, a batch of the oldest
+ * chunks at a time, and the lock is only held per chunk. Returns the
+ * number of chunks reclaimed.
+ */
+int buddy_scavenge(u64 delay_ms, usize retain, int flags) {
+    scavenge_pick_t pick[SCAVENGE_BATCH];
+    buddy_zone_t *z = zone;
+    int nchunk = 0;
+
+    if (!z) return -ENOENT;
+
+    u64 now = now_ms();
+    if (now < delay_ms) return 0;
+
+    for (;;) {
+        int n    = scavenge_pick(z, now - delay_ms, pick);
+        int prev = nchunk;
+
+        for (int i = 0; i < n; ++i) {
+            int err = scavenge_chunk(z, &pick[i], retain, flags);
+            if (err == -ENOSPC)
+                return nchunk;
+            if (err < 0)
+                return nchunk ? nchunk : err;
+            nchunk += err;
         }
+
+        // A short batch was every candidate, one that reclaimed nothing
+        // only found chunks that changed under it.
+        if (n < SCAVENGE_BATCH || nchunk == prev)
+            return nchunk;
     }
 }
 
+// Size of the zone header plus metadata, the arena starts right after it.
+static usize zone_hdrsize(usize memsize) {
+    return ALIGN_UP(sizeof(buddy_zone_t) + zone_metasize(memsize) +
+                    zone_dirtysize(memsize) + zone_chunksize(memsize), PGSZ);
+}
+
+// Carve an empty arena into its top blocks.
+static int zone_carve(buddy_zone_t *z) {
+    // Greedily take the largest power-of-two block that still fits, this
+    // keeps every top block naturally aligned to its own size.
+    for (u64 addr = 0; addr < z->memsize;) {
+        u64 order = z->norder - 1;
+        while (addr + order_size(order) > z->memsize)
+            order--;
+
+        int err = put_top(z, addr, order);
+        if (err) return err;
+        chunk_idle(z, addr, order);
+        addr += order_size(order);
+    }
+    return 0;
+}
+
+// Lay out a fresh zone over 'z', carving the arena into maximal top blocks.
+static int zone_format(buddy_zone_t *z, usize size, usize memsize) {
+    memset(z, 0, sizeof *z);
+    z->version  = BUDDY_VERSION;
+    z->backend  = BUDDY_BACKEND;
+    z->size     = size;
+    z->memsize  = memsize;
+    z->arena    = zone_hdrsize(memsize);
+    z->norder   = get_order(memsize) + 1;
+    z->dirty    = sizeof *z + zone_metasize(memsize);
+    z->chunks   = z->dirty + zone_dirtysize(memsize);
+    z->nchunk   = memsize / CHUNK_SIZE;
+    z->lock     = SPINLOCK_INIT();
+    zone_clear(z);
+    memset(zone_chunks(z), 0, zone_chunksize(memsize));
+
+    int err = zone_carve(z);
+    if (err) return err;
+
+    z->magic = BUDDY_MAGIC;
+    return 0;
+}
+
+// Check that 'z' holds a cleanly detached zone with the expected geometry.
+static int zone_attach(buddy_zone_t *z, usize size, usize memsize) {
+    if (z->magic != BUDDY_MAGIC || z->version != BUDDY_VERSION ||
+        z->backend != BUDDY_BACKEND)
+        return -EINVAL;
+
+    if (z->size != size || z->memsize != memsize ||
+        z->arena != zone_hdrsize(memsize))
+        return -EINVAL;
+
+    // A zone that was not detached may have been caught mid-update.
+    if (!z->clean)
+        return -EUCLEAN;
+
+    // The lock is never held across a detach, only its owner is stale.
+    z->lock  = SPINLOCK_INIT();
+    z->clean = 0;
+    return 0;
+}
+
+/**
+ * Drop every allocation of zone 'z' at once, NULL selects the current zone.
+ *
+ * The zone goes back to its freshly formatted state without walking what
+ * is allocated: the list backend rewinds its descriptor pool and lists,
+ * the bitmap backend clears its bitmaps, and the top blocks are put back.
+ * That is O(1) plus one step per top block, the bitmaps and the dirty bits
+ * are a memset of a few bits per page. Pointers into the zone must not be
+ * used afterwards.
+ */
+int buddy_zone_reset(buddy_zone_t *z) {
+    if (!z) z = zone;
+    if (!z) return -EINVAL;
+
+    buddy_trace_attach();
+    spin_lock(&z->lock);
+    zone_clear(z);
+    memset(z->nfree, 0, sizeof z->nfree);
+    memset(z->nused, 0, sizeof z->nused);
+
+    // What was allocated is not known, so nothing is known zero anymore.
+    memset(zone_dirty(z), 0xff, zone_dirtysize(z->memsize));
+
+    int err = zone_carve(z);
+    zone_trace(z, BUDDY_EV_RESET, 0, BUDDY_NIL);
+    spin_unlock(&z->lock);
+    buddy_trace_flush();
+
+    // Every order below the top ones is empty now.
+    if (!err && z == zone)
+        buddy_refill_kick();
+    return err;
+}
+
+/**
+ * Create a zone with at least 'size' bytes of arena inside a single block
+ * of 'parent', NULL selects the current zone. It is a region: allocations
+ * are made with buddy_zone_alloc() and all dropped by buddy_zone_reset()
+ * when its work is done. The zone gets whatever the block has left over.
+ */
+buddy_zone_t *buddy_zone_create(buddy_zone_t *parent, usize size) {
+    usize memsize = ALIGN_UP(size, PGSZ);
+    if (!memsize) return NULL;
+
+    usize bsize = order_size(get_order(zone_hdrsize(memsize) + memsize));
+    usize fill  = PGROUND(bsize - zone_hdrsize(bsize));
+    if (fill > memsize)
+        memsize = fill;
+
+    buddy_zone_t *z = buddy_zone_alloc(parent, bsize);
+    if (!z) return NULL;
+
+    if (zone_format(z, bsize, memsize)) {
+        buddy_zone_free_sized(parent, z, bsize);
+        return NULL;
+    }
+    z->flags |= (parent ? parent : zone)->flags & BUDDY_ZONE_ANON;
+
+    // Unlike a fresh mapping, the block may hold anything.
+    memset(zone_dirty(z), 0xff, zone_dirtysize(z->memsize));
+    return z;
+}
+
+// Give a zone made by buddy_zone_create() back to its parent.
+void buddy_zone_destroy(buddy_zone_t *parent, buddy_zone_t *z) {
+    if (!z) return;
+
+    z->magic = 0;
+    buddy_zone_free_sized(parent, z, z->size);
+}
+
 // Initialize buddy allocator
 int buddy_init(void) {
-    memsize = KiB(32); // 32KB memory for the buddy system
+    return buddy_init_size(KiB(32)); // 32KB memory for the buddy system
+}
+
+// Initialize the buddy allocator over an anonymous arena of 'size' bytes.
+int buddy_init_size(usize size) {
+    usize memsize = PGROUND(size);
+    usize zsize   = zone_hdrsize(memsize) + memsize;
+
+    if (!memsize) return -EINVAL;
+
+    buddy_fini();
+
+    // Start the arena on a multiple of its largest top block, so blocks are
+    // naturally aligned in the address space and not only within the arena.
+    usize align = order_size(get_order(memsize));
+    if (align > memsize)
+        align >>= 1;
 
-    memset(free_list, 0, sizeof(free_list));
-    memset(used_list, 0, sizeof(used_list));
+    usize msize = zsize + align - PGSZ;
+    u8 *base = mmap(NULL, msize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return -ENOMEM;
 
-    // Initialize memory pool with buddy blocks
-    pool = (buddy_t *)calloc(NPAGE(memsize), sizeof(buddy_t));
-    if (!pool) return -ENOMEM;
+    u8 *arena = (u8 *)ALIGN_UP((uintptr_t)base + zone_hdrsize(memsize), align);
+    buddy_zone_t *z = (buddy_zone_t *)(arena - zone_hdrsize(memsize));
 
-    for (usize i = 0; i < NPAGE(memsize); ++i) {
-        put_pool(&pool[i]);
+    // Trim the slack on both sides.
+    if ((u8 *)z != base)
+        munmap(base, (u8 *)z - base);
+    if ((u8 *)z + zsize != base + msize)
+        munmap((u8 *)z + zsize, base + msize - ((u8 *)z + zsize));
+
+    int err = zone_format(z, zsize, memsize);
+    if (err) {
+        munmap(z, zsize);
+        return err;
     }
+    z->flags |= BUDDY_ZONE_ANON;
 
-    // Initialize the first large block
-    buddy_t *block = NULL;
-    int err = get_pool(&block);
-    if (err) return err;
+    zone = z;
+    return 0;
+}
 
-    block->addr = 0;
-    block->order = get_order(memsize);
-    block->state = BUDDY_FREE;
+// Initialize the buddy allocator over a snapshot file, re-attaching to the
+// zone already stored in it or formatting a new one if the file is empty.
+int buddy_init_file(const char *path, usize size) {
+    struct stat st;
+    usize memsize = PGROUND(size);
+    usize zsize   = zone_hdrsize(memsize) + memsize;
+    int   err     = 0;
+
+    if (!path || !memsize)
+        return -EINVAL;
+
+    buddy_fini();
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -errno;
+
+    if (fstat(fd, &st)) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+
+    int fresh = st.st_size == 0;
+    if (fresh && ftruncate(fd, zsize)) {
+        err = -errno;
+        close(fd);
+        return err;
+    } else if (!fresh && (usize)st.st_size != zsize) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    buddy_zone_t *z = mmap(NULL, zsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (z == MAP_FAILED) return -ENOMEM;
+
+    if (fresh)
+        err = zone_format(z, zsize, memsize);
+    else
+        err = zone_attach(z, zsize, memsize);
 
-    return put_free(block);
-}
\ No newline at end of file
+    if (err) {
+        munmap(z, zsize);
+        return err;
+    }
+
+    zone = z;
+    return 0;
+}
+
+// Flush the zone to its backing file, if any.
+int buddy_sync(void) {
+    if (!zone) return -EINVAL;
+    return msync(zone, zone->size, MS_SYNC) ? -errno : 0;
+}
+
+// Detach from the current zone, marking it clean so it can be re-attached.
+void buddy_fini(void) {
+    if (!zone) return;
+
+    buddy_refill_stop();
+    buddy_scavenger_stop();
+
+    zone->clean = 1;
+    buddy_sync();
+    munmap(zone, zone->size);
+    zone = NULL;
+}
@@ -0,0 +1,259 @@
+#include "include/buddy.h"
+#include "include/epoch.h"
+#include "include/shrink.h"
+#include "include/spinlock.h"
+#include "include/thread.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define EPOCH_ACTIVE    1ull    // set in a record's epoch while inside a section.
+#define EPOCH_STEP      2ull    // epochs advance past the ACTIVE bit.
+#define EPOCH_NLIMBO    3       // retire epochs a record tracks at once.
+#define EPOCH_COST      8       // shrinker cost, advancing scans every record.
+
+// A page worth of retired blocks, mapped directly so retiring never needs the arena.
+typedef struct limbo_t {
+    struct limbo_t  *next;
+    usize           count;
+    u64             epoch;      // epoch its blocks were retired in.
+    void            *ptr[(PGSZ - 3 * sizeof(usize)) / sizeof(void *)];
+} limbo_t;
+
+// Per-thread epoch state, see thread.h.
+typedef struct epoch_rec_t {
+    thread_rec_t        rec;        // registered record.
+    u64                 epoch;      // observed global epoch | EPOCH_ACTIVE.
+    u64                 nesting;    // read-side section depth.
+    u64                 pending;    // deferred frees since the last reclaim.
+    struct {
+        u64             epoch;      // epoch its blocks were retired in.
+        limbo_t         *head;
+    } limbo[EPOCH_NLIMBO];
+} epoch_rec_t;
+
+static u64              epoch_global = EPOCH_STEP;
+static spinlock_t       epoch_lock   = SPINLOCK_INIT();
+static thread_rec_t     *epoch_recs  = NULL;
+static limbo_t          *epoch_orphans = NULL;  // limbo left by exited threads, under epoch_lock.
+static pthread_key_t    epoch_key;
+static pthread_once_t   epoch_once   = PTHREAD_ONCE_INIT;
+static __thread epoch_rec_t *epoch_self = NULL;
+
+// Give a chain of limbo pages and everything on them back to the allocator.
+// Callers unlink the chain first: freeing may set up a trace ring, which
+// can malloc() and, in a full arena, run epoch_shrink() on this thread.
+static void limbo_free(limbo_t *limbo) {
+    limbo_t *next = NULL;
+
+    forlinked(l, limbo, next) {
+        next = l->next;
+        buddy_free_bulk(l->ptr, l->count);
+        munmap(l, sizeof *l);
+    }
+}
+
+// Free the orphaned limbo pages whose grace period has elapsed.
+static int epoch_reclaim_orphans(u64 g) {
+    if (!__atomic_load_n(&epoch_orphans, __ATOMIC_RELAXED))
+        return 0;
+    // Another thread is already at it, or an exit is handing pages over.
+    if (!spin_trylock(&epoch_lock))
+        return 0;
+
+    limbo_t *done = NULL, *next = NULL, **link = &epoch_orphans;
+    forlinked(l, epoch_orphans, next) {
+        next = l->next;
+        if (l->epoch + 2 * EPOCH_STEP <= g) {
+            *link   = next;
+            l->next = done;
+            done    = l;
+        } else {
+            link = &l->next;
+        }
+    }
+    spin_unlock(&epoch_lock);
+
+    int n = 0;
+    forlinked(l, done, next) {
+        next = l->next;
+        buddy_free_bulk(l->ptr, l->count);
+        munmap(l, sizeof *l);
+        n++;
+    }
+    return n;
+}
+
+// Reclaim every limbo list of 'rec' whose grace period has elapsed.
+static int epoch_reclaim(epoch_rec_t *rec) {
+    u64 g = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    for (int i = 0; i < EPOCH_NLIMBO; ++i) {
+        if (rec->limbo[i].head && rec->limbo[i].epoch + 2 * EPOCH_STEP <= g) {
+            limbo_t *head = rec->limbo[i].head;
+            rec->limbo[i].head = NULL;
+            limbo_free(head);
+            n++;
+        }
+    }
+    return n + epoch_reclaim_orphans(g);
+}
+
+// Advance the global epoch if every active reader has observed it.
+static int epoch_try_advance(void) {
+    u64 g = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+
+    forrecs(rec, epoch_recs, epoch_rec_t) {
+        u64 e = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+        if ((e & EPOCH_ACTIVE) && (e & ~EPOCH_ACTIVE) != g)
+            return 0;
+    }
+
+    // Losing the race means someone else advanced it, which is as good.
+    __atomic_compare_exchange_n(&epoch_global, &g, g + EPOCH_STEP, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+// Thread exit, hand our limbo to the orphan list and leave the record for reuse.
+static void epoch_exit_thread(void *arg) {
+    epoch_rec_t *rec = arg;
+
+    rec->nesting = 0;
+    rec->pending = 0;
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+
+    // Pages keep their retire epoch, whoever reclaims next frees them in time.
+    for (int i = 0; i < EPOCH_NLIMBO; ++i) {
+        limbo_t *head = rec->limbo[i].head, *tail = head;
+        if (!head) continue;
+
+        while (tail->next)
+            tail = tail->next;
+        spin_lock(&epoch_lock);
+        tail->next    = epoch_orphans;
+        epoch_orphans = head;
+        spin_unlock(&epoch_lock);
+        rec->limbo[i].head = NULL;
+    }
+
+    epoch_self = NULL;
+    thread_rec_put(rec);
+}
+
+// Shrinker, reclaim what this thread deferred if no reader still holds it.
+static usize epoch_shrink(void *arg __unused, int order __unused) {
+    epoch_rec_t *rec = epoch_self;
+    if (!rec) return 0;
+
+    // Two steps are a full grace period, unless a reader holds us back.
+    if (epoch_try_advance())
+        epoch_try_advance();
+    return epoch_reclaim(rec);
+}
+
+static void epoch_init_key(void) {
+    pthread_key_create(&epoch_key, epoch_exit_thread);
+    buddy_shrinker_register(epoch_shrink, NULL, EPOCH_COST);
+}
+
+// Get this thread's record, adopting one left by an exited thread if possible.
+static epoch_rec_t *epoch_get(void) {
+    epoch_rec_t *rec = epoch_self;
+    if (rec) return rec;
+
+    pthread_once(&epoch_once, epoch_init_key);
+
+    if (!(rec = thread_rec_get(&epoch_recs, &epoch_lock, sizeof *rec)))
+        return NULL;
+
+    pthread_setspecific(epoch_key, rec);
+    return epoch_self = rec;
+}
+
+// Enter a read-side section, sections nest.
+void buddy_epoch_enter(void) {
+    epoch_rec_t *rec = epoch_get();
+    assert(rec, "no epoch record");
+
+    if (rec->nesting++)
+        return;
+
+    u64 g = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->epoch, g | EPOCH_ACTIVE, __ATOMIC_RELAXED);
+    // Publish the epoch before any shared pointer is read.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void buddy_epoch_exit(void) {
+    epoch_rec_t *rec = epoch_self;
+    assert(rec && rec->nesting, "not in a read-side section");
+
+    if (--rec->nesting == 0)
+        __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Add 'ptr' to the limbo of the current epoch.
+static int limbo_push(epoch_rec_t *rec, void *ptr) {
+    u64 g = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+    typeof(rec->limbo[0]) *bucket = &rec->limbo[(g / EPOCH_STEP) % EPOCH_NLIMBO];
+
+    // The bucket last held an epoch at least three steps back, it is safe.
+    if (bucket->epoch != g) {
+        limbo_t *head = bucket->head;
+        bucket->head  = NULL;
+        bucket->epoch = g;
+        limbo_free(head);
+    }
+
+    limbo_t *limbo = bucket->head;
+    if (!limbo || limbo->count == NELEM(limbo->ptr)) {
+        // Not buddy_alloc(), retiring must not fail when the arena is full.
+        limbo_t *l = mmap(NULL, sizeof *l, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (l == MAP_FAILED) return -ENOMEM;
+
+        l->next  = limbo;
+        l->count = 0;
+        l->epoch = g;
+        bucket->head = limbo = l;
+    }
+
+    limbo->ptr[limbo->count++] = ptr;
+    return 0;
+}
+
+// Free 'ptr' once no reader can still hold a reference to it.
+int buddy_free_deferred(void *ptr) {
+    if (!ptr) return 0;
+
+    epoch_rec_t *rec = epoch_get();
+    if (!rec) return -ENOMEM;
+
+    int err = limbo_push(rec, ptr);
+    if (err) return err;
+
+    if (++rec->pending >= BUDDY_EPOCH_BATCH) {
+        rec->pending = 0;
+        epoch_try_advance();
+        epoch_reclaim(rec);
+    }
+    return 0;
+}
+
+// Wait for a full grace period and reclaim everything this thread deferred.
+void buddy_epoch_barrier(void) {
+    epoch_rec_t *rec = epoch_get();
+    assert(rec && !rec->nesting, "barrier inside a read-side section");
+
+    u64 g = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE) < g + 2 * EPOCH_STEP) {
+        if (!epoch_try_advance())
+            sched_yield();
+    }
+
+    rec->pending = 0;
+    epoch_reclaim(rec);
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+// C++ has no _Atomic qualifier, it only needs the macros below.
+#ifndef __cplusplus
 typedef _Atomic volatile unsigned long atomic_t;
+#endif
 
 #define atomic_inc(p) ({                        \
     __atomic_fetch_add(p, 1, __ATOMIC_SEQ_CST); \
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "defs.h"
+#include "spinlock.h"
 
 #define BUDDY_NORDER    37 // maximum posible orders supported.
 
@@ -8,13 +9,13 @@
 #define BUDDY_PARTIAL   1 // Partially filled buddy block.
 #define BUDDY_FULL      2 // Fully filled buddy block
 
+#define BUDDY_NIL       (~0ull) // 'null' descriptor index.
+
 typedef struct buddy_t {
-    u64         addr;   // base address of block.
+    u64         addr;   // offset of the block from the start of the arena.
     u64         order;  // as an index of the base 2, and order-level.
     u64         state;  // can be FULL, PARTIAL or FREE.
-    buddy_t     *next;  // next block in this order of blocks.
-    void        *pages; // array of pages in this block.
-    u64         *bitmap;// bitmap of blocks in this block.
+    u64         next;   // index of the next block in this order of blocks.
 } __packed buddy_t;
 
 #define buddy_addr(b)           ({ (b)->addr; })
@@ -24,13 +25,118 @@ typedef struct buddy_t {
 #define BUDDY_LEFT      1
 #define BUDDY_RIGHT     2
 
+// Only blocks of the same order whose union is aligned to the next order are buddies.
 #define buddy_isbuddy(b, __b1)    ({\
-    (buddy_end(b) == buddy_addr(__b1)) ? BUDDY_RIGHT : \
-    (buddy_end(__b1) == buddy_addr(b)) ? BUDDY_LEFT : 0;\
+    ((b)->order != (__b1)->order) ? 0 : \
+    (buddy_addr(b) ^ buddy_size(b)) != buddy_addr(__b1) ? 0 : \
+    (buddy_end(b) == buddy_addr(__b1)) ? BUDDY_RIGHT : BUDDY_LEFT;\
 })
 
+#define BUDDY_MAGIC     (0x5a4f4e4559444442ull) // "BDDYENOZ"
+#define BUDDY_VERSION   8
+
+#define BUDDY_BACKEND_LIST      1 // linked free lists of descriptors, used ones indexed by page.
+#define BUDDY_BACKEND_BITMAP    2 // per-order bitmap trees, see buddy_map_t.
+
+#define BUDDY_ZONE_ANON         1 // private anonymous, reads as zero once dropped.
+
+#define BUDDY_CHUNK_ORDER       9 // scavenger granularity, a 2MiB huge page.
+
+#define BUDDY_SCAVENGE_LAZY     1 // MADV_FREE instead of MADV_DONTNEED.
+
+#ifdef BUDDY_BITMAP
+#define BUDDY_BACKEND   BUDDY_BACKEND_BITMAP
+#else
+#define BUDDY_BACKEND   BUDDY_BACKEND_LIST
+#endif
+
+#define BUDDY_MAP_NLEVEL    7 // enough 64-ary levels for 2^36 blocks.
+
+/**
+ * Free blocks of one order as a 64-ary tree of bitmap words. A bit in
+ * a summary level is set when the word below it has any bit set, so a free
+ * block is found with one ctz per level. Offsets are in words from the
+ * start of the zone's bitmap area.
+ */
+typedef struct buddy_map_t {
+    u64         nbit;       // blocks of this order that fit in the arena.
+    u64         nlevel;     // levels in the tree, the last one is one word.
+    u64         level[BUDDY_MAP_NLEVEL]; // leaves first.
+    u64         used;       // flat bitmap of allocated blocks.
+} buddy_map_t;
+
+/**
+ * A zone is a single mapping holding this header, the block metadata
+ * and the arena itself. Everything in it is an offset or an index so the
+ * mapping can be backed by a file and re-attached at a different address.
+ */
+typedef struct buddy_zone_t {
+    u64         magic;      // BUDDY_MAGIC once the zone is formatted.
+    u64         version;    // layout version, see BUDDY_VERSION.
+    u64         backend;    // BUDDY_BACKEND the zone was formatted with.
+    u64         clean;      // set when the zone was detached cleanly.
+    u64         size;       // size of the whole mapping in bytes.
+    u64         memsize;    // size of the arena in bytes.
+    u64         arena;      // offset of the arena from the start of the zone.
+    u64         norder;     // number of orders this arena actually spans.
+    u64         ndesc;      // number of block descriptors.
+    u64         pool;       // first recycled descriptor.
+    u64         bump;       // first descriptor never handed out.
+    spinlock_t  lock;       // serializes the zone, reset on attach.
+    u64         free_list[BUDDY_NORDER];
+    u64         nfree[BUDDY_NORDER];    // blocks on each free list.
+    u64         nused[BUDDY_NORDER];    // used blocks of each order.
+    u64         wmark_low[BUDDY_NORDER];  // refill an order below this many free blocks,
+    u64         wmark_high[BUDDY_NORDER]; // up to this many.
+    u64         dirty;      // offset of the per-page dirty bitmap.
+    u64         flags;      // BUDDY_ZONE_* flags.
+    u64         chunks;     // offset of the per-chunk idle stamps.
+    u64         nchunk;     // chunks of BUDDY_CHUNK_ORDER in the arena.
+    u64         nreclaimed; // chunks whose pages were given back to the OS.
+#ifdef BUDDY_BITMAP
+    u64         words;      // offset of the bitmap words from the zone.
+    buddy_map_t map[BUDDY_NORDER];
+#endif
+    buddy_t     desc[];     // block descriptors then their page index, unused by the bitmap backend.
+} buddy_zone_t;
+
+#define zone_arena(z)           ({ (uintptr_t)(z) + (z)->arena; })
+#define zone_ptr(z, a)          ({ (void *)(zone_arena(z) + (a)); })
+#define zone_off(z, p)          ({ (u64)((uintptr_t)(p) - zone_arena(z)); })
+
+typedef struct buddy_stats_t {
+    usize       memsize;    // size of the arena in bytes.
+    usize       free;       // bytes in free blocks.
+    usize       used;       // bytes in allocated blocks.
+    int         norder;     // orders spanned by the arena.
+    int         maxfree;    // order of the largest free block, -1 if none.
+    usize       reclaimed;  // free bytes given back to the OS, not resident.
+    u64         nfree[BUDDY_NORDER];
+    u64         nused[BUDDY_NORDER];
+} buddy_stats_t;
+
 extern void *buddy_alloc(usize size);
+extern void *buddy_zalloc(usize size);
 extern void buddy_free(void *ptr);
+extern void buddy_free_sized(void *ptr, usize size);
+extern void buddy_free_bulk(void **ptrs, usize n);
+
+extern buddy_zone_t *buddy_zone(void);
+extern void *buddy_zone_alloc(buddy_zone_t *zone, usize size);
+extern void buddy_zone_free(buddy_zone_t *zone, void *ptr);
+extern void buddy_zone_free_sized(buddy_zone_t *zone, void *ptr, usize size);
+extern int buddy_zone_reset(buddy_zone_t *zone);
+extern buddy_zone_t *buddy_zone_create(buddy_zone_t *parent, usize size);
+extern void buddy_zone_destroy(buddy_zone_t *parent, buddy_zone_t *zone);
 extern int buddy_init(void);
+extern int buddy_init_size(usize size);
+extern int buddy_init_file(const char *path, usize size);
+extern int buddy_sync(void);
+extern void buddy_fini(void);
+extern int buddy_stats(buddy_stats_t *stats);
+extern int buddy_set_watermark(int order, usize low, usize high);
+extern int buddy_refill(void);
+extern int buddy_coalesce(void);
+extern int buddy_scavenge(u64 delay_ms, usize retain, int flags);
 extern void dump_free_list();
-extern void dump_used_list();
\ No newline at end of file
+extern void dump_used_list();
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "buddy.h"
+}
+
+/**
+ * C++ adapters over a buddy zone.
+ *
+ *  buddy::resource      std::pmr::memory_resource over a zone.
+ *  buddy::allocator<T>  STL allocator over a zone.
+ *  buddy::arena         monotonic resource carving objects out of blocks
+ *                       taken from an upstream resource, arenas nest.
+ *
+ * A null zone means the current one, see buddy_zone(). Deallocation passes
+ * the size down to buddy_zone_free_sized(), which finds the block in O(1)
+ * in both backends. Requests larger than the arena throw std::bad_alloc.
+ * Blocks are page aligned, so larger alignments are refused the same way.
+ */
+
+namespace buddy {
+
+class resource : public std::pmr::memory_resource {
+public:
+    explicit resource(buddy_zone_t *zone = nullptr) noexcept : zone_(zone) {}
+
+    buddy_zone_t *zone() const noexcept { return zone_; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *ptr = align <= PGSZ ? buddy_zone_alloc(zone_, bytes) : nullptr;
+        if (!ptr) throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override {
+        buddy_zone_free_sized(zone_, ptr, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        auto *r = dynamic_cast<const resource *>(&other);
+        return r && r->zone_ == zone_;
+    }
+
+    buddy_zone_t *zone_;
+};
+
+// The resource over the current zone.
+inline resource *default_resource() noexcept {
+    static resource r;
+    return &r;
+}
+
+template <typename T>
+class allocator {
+public:
+    using value_type = T;
+
+    static_assert(alignof(T) <= PGSZ, "buddy blocks are only page aligned");
+
+    allocator(buddy_zone_t *zone = nullptr) noexcept : zone_(zone) {}
+
+    template <typename U>
+    allocator(const allocator<U> &other) noexcept : zone_(other.zone()) {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::size_t(-1) / sizeof(T))
+            throw std::bad_array_new_length();
+
+        void *ptr = buddy_zone_alloc(zone_, n * sizeof(T));
+        if (!ptr) throw std::bad_alloc();
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        buddy_zone_free_sized(zone_, ptr, n * sizeof(T));
+    }
+
+    buddy_zone_t *zone() const noexcept { return zone_; }
+
+private:
+    buddy_zone_t *zone_;
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &a, const allocator<U> &b) noexcept {
+    return a.zone() == b.zone();
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T> &a, const allocator<U> &b) noexcept {
+    return !(a == b);
+}
+
+/**
+ * Bump allocation out of power-of-two chunks taken from 'upstream', each
+ * chunk twice the previous one up to 'maxchunk'. Deallocation is a no-op,
+ * everything is handed back at once by release() or the destructor. An
+ * arena can be the upstream of another one for nested lifetimes.
+ */
+class arena : public std::pmr::memory_resource {
+public:
+    explicit arena(std::pmr::memory_resource *upstream = default_resource(),
+                   std::size_t chunk = PGSZ, std::size_t maxchunk = MiB(1)) noexcept
+        : upstream_(upstream), next_(chunk), max_(maxchunk) {}
+
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    ~arena() override { release(); }
+
+    // Give every chunk back to the upstream resource.
+    void release() noexcept {
+        while (chunks_) {
+            chunk_t *c = chunks_;
+            chunks_ = c->next;
+            upstream_->deallocate(c, c->size, alignof(std::max_align_t));
+        }
+        cur_ = end_ = nullptr;
+    }
+
+    std::pmr::memory_resource *upstream() const noexcept { return upstream_; }
+
+private:
+    struct chunk_t {
+        chunk_t     *next;
+        std::size_t size;
+    };
+
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *ptr = bump(bytes, align);
+        if (ptr) return ptr;
+        // Doubling the chunk size past this would wrap.
+        if (bytes > SIZE_MAX / 4 || align > SIZE_MAX / 4)
+            throw std::bad_alloc();
+
+        // Grow geometrically, but always fit the request and the header.
+        std::size_t size = next_;
+        while (size < sizeof(chunk_t) + bytes + align)
+            size *= 2;
+        if (next_ < max_)
+            next_ *= 2;
+
+        auto *c = static_cast<chunk_t *>(upstream_->allocate(size, alignof(std::max_align_t)));
+        c->next = chunks_;
+        c->size = size;
+        chunks_ = c;
+        cur_    = reinterpret_cast<char *>(c + 1);
+        end_    = reinterpret_cast<char *>(c) + size;
+
+        return bump(bytes, align);
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    void *bump(std::size_t bytes, std::size_t align) noexcept {
+        if (!cur_) return nullptr;
+
+        std::uintptr_t p = (reinterpret_cast<std::uintptr_t>(cur_) + align - 1) & ~(align - 1);
+        if (p + bytes > reinterpret_cast<std::uintptr_t>(end_))
+            return nullptr;
+
+        cur_ = reinterpret_cast<char *>(p + bytes);
+        return reinterpret_cast<void *>(p);
+    }
+
+    std::pmr::memory_resource   *upstream_;
+    chunk_t                     *chunks_ = nullptr;
+    char                        *cur_    = nullptr;
+    char                        *end_    = nullptr;
+    std::size_t                 next_;
+    std::size_t                 max_;
+};
+
+} // namespace buddy
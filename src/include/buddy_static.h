@@ -0,0 +1,145 @@
+#pragma once
+
+#include "buddy.h"
+#include "assert.h"
+#include <pthread.h>
+
+/**
+ * Header-only buddy allocator instances with a fixed geometry.
+ *
+ * BUDDY_STATIC_DEFINE(name, pgsz, min_order, max_order) expands to a
+ * statically sized arena of (pgsz << max_order) bytes and the functions
+ * name##_init(), name##_alloc() and name##_free(). Blocks range from
+ * (pgsz << min_order) to the whole arena. Every bound is a compile time
+ * constant, so the per-order loops unroll, the metadata arrays have
+ * exactly one slot per order and per smallest block, and the range checks
+ * of the runtime allocator fold away.
+ *
+ * The algorithm is the one in buddy.c: free and used lists per order,
+ * linked through indices into a descriptor pool.
+ */
+
+#define BUDDY_STATIC_NIL                    (~0u)
+
+#define __bs_norder(__min, __max)           ((__max) - (__min) + 1)
+#define __bs_nblock(__min, __max)           (1u << ((__max) - (__min)))
+#define __bs_bsize(__pgsz, __min, o)        ((usize)(__pgsz) << ((__min) + (o)))
+
+#define BUDDY_STATIC_DEFINE(name, __pgsz, __min, __max)                            \
+    _Static_assert(((__pgsz) & ((__pgsz) - 1)) == 0,                               \
+                   #name ": page size must be a power of 2");                      \
+    _Static_assert((__min) <= (__max) && (__max) - (__min) < 32,                   \
+                   #name ": invalid order range");                                 \
+                                                                                   \
+    static struct {                                                                \
+        u8      arena[__bs_bsize(__pgsz, __min, __max - __min)];                   \
+        u32     free_list[__bs_norder(__min, __max)];                              \
+        u32     used_list[__bs_norder(__min, __max)];                              \
+        u32     pool;                                                              \
+        u32     bump;                                                              \
+        struct {                                                                   \
+            u32 addr;   /* offset in smallest blocks. */                           \
+            u32 next;                                                              \
+            u8  order;  /* relative to min_order. */                               \
+            u8  state;                                                             \
+        } desc[__bs_nblock(__min, __max)];                                         \
+    } __aligned(__pgsz) __unused name;                                             \
+                                                                                   \
+    static inline u32 name##_get_pool(void) {                                      \
+        u32 i = name.pool;                                                         \
+        if (i != BUDDY_STATIC_NIL)                                                 \
+            name.pool = name.desc[i].next;                                         \
+        else if (name.bump < __bs_nblock(__min, __max))                            \
+            i = name.bump++;                                                       \
+        return i;                                                                  \
+    }                                                                              \
+                                                                                   \
+    static inline void name##_put_list(u32 *list, u32 i) {                         \
+        name.desc[i].next = list[name.desc[i].order];                              \
+        list[name.desc[i].order] = i;                                              \
+    }                                                                              \
+                                                                                   \
+    /* Unlink the block at 'addr' from list[o], returning its index. */            \
+    static inline u32 name##_take(u32 *list, int o, u32 addr) {                    \
+        u32 prev = BUDDY_STATIC_NIL;                                               \
+        for (u32 i = list[o]; i != BUDDY_STATIC_NIL; i = name.desc[i].next) {      \
+            if (name.desc[i].addr == addr) {                                       \
+                if (prev != BUDDY_STATIC_NIL)                                      \
+                    name.desc[prev].next = name.desc[i].next;                      \
+                else                                                               \
+                    list[o] = name.desc[i].next;                                   \
+                return i;                                                          \
+            }                                                                      \
+            prev = i;                                                              \
+        }                                                                          \
+        return BUDDY_STATIC_NIL;                                                   \
+    }                                                                              \
+                                                                                   \
+    static inline void name##_init(void) {                                         \
+        for (int o = 0; o < __bs_norder(__min, __max); ++o) {                      \
+            name.free_list[o] = BUDDY_STATIC_NIL;                                  \
+            name.used_list[o] = BUDDY_STATIC_NIL;                                  \
+        }                                                                          \
+        name.pool = BUDDY_STATIC_NIL;                                              \
+        name.bump = 0;                                                             \
+                                                                                   \
+        u32 top = name##_get_pool();                                               \
+        name.desc[top].addr  = 0;                                                  \
+        name.desc[top].order = __max - __min;                                      \
+        name.desc[top].state = BUDDY_FREE;                                         \
+        name##_put_list(name.free_list, top);                                      \
+    }                                                                              \
+                                                                                   \
+    static inline void *name##_alloc(usize size) {                                 \
+        int order = 0;                                                             \
+        while (order < __bs_norder(__min, __max) &&                                \
+               size > __bs_bsize(__pgsz, __min, order))                            \
+            order++;                                                               \
+                                                                                   \
+        for (int o = order; o < __bs_norder(__min, __max); ++o) {                  \
+            u32 i = name.free_list[o];                                             \
+            if (i == BUDDY_STATIC_NIL)                                             \
+                continue;                                                          \
+            name.free_list[o] = name.desc[i].next;                                 \
+                                                                                   \
+            /* Split down, handing the upper halves to the free lists. */          \
+            while (name.desc[i].order > order) {                                   \
+                u32 b = name##_get_pool();                                         \
+                name.desc[i].order -= 1;                                           \
+                name.desc[b].order = name.desc[i].order;                           \
+                name.desc[b].addr  = name.desc[i].addr +                           \
+                                     (1u << name.desc[i].order);                   \
+                name.desc[b].state = BUDDY_FREE;                                   \
+                name##_put_list(name.free_list, b);                                \
+            }                                                                      \
+                                                                                   \
+            name.desc[i].state = BUDDY_FULL;                                       \
+            name##_put_list(name.used_list, i);                                    \
+            return &name.arena[__bs_bsize(__pgsz, __min, 0) * name.desc[i].addr];  \
+        }                                                                          \
+        return NULL;                                                               \
+    }                                                                              \
+                                                                                   \
+    static inline void name##_free(void *ptr) {                                    \
+        u32 addr = ((u8 *)ptr - name.arena) / __bs_bsize(__pgsz, __min, 0);        \
+        u32 i = BUDDY_STATIC_NIL;                                                  \
+                                                                                   \
+        for (int o = 0; i == BUDDY_STATIC_NIL &&                                   \
+                        o < __bs_norder(__min, __max); ++o)                        \
+            i = name##_take(name.used_list, o, addr);                              \
+        assert(i != BUDDY_STATIC_NIL, #name ": freeing an unallocated block");     \
+                                                                                   \
+        while (name.desc[i].order < __max - __min) {                               \
+            int o = name.desc[i].order;                                            \
+            u32 b = name##_take(name.free_list, o, name.desc[i].addr ^ (1u << o)); \
+            if (b == BUDDY_STATIC_NIL)                                             \
+                break;                                                             \
+            name.desc[i].addr &= name.desc[b].addr;                                \
+            name.desc[i].order += 1;                                               \
+            name.desc[b].next = name.pool;                                         \
+            name.pool = b;                                                         \
+        }                                                                          \
+                                                                                   \
+        name.desc[i].state = BUDDY_FREE;                                           \
+        name##_put_list(name.free_list, i);                                        \
+    }
@@ -13,7 +13,8 @@
 
 #define __CAT(a, b)                 a##b
 
-#ifndef nullptr
+// nullptr is a keyword in C++, not a macro.
+#if !defined(nullptr) && !defined(__cplusplus)
 #define nullptr     ((void *)0)
 #endif
 
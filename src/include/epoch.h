@@ -0,0 +1,31 @@
+#pragma once
+
+#include "defs.h"
+
+/**
+ * Epoch based deferred freeing for lock-free readers.
+ *
+ * Readers bracket their traversals with buddy_epoch_enter()/exit(), which
+ * only publish the global epoch in a per-thread record. Writers unlink a
+ * node and hand it to buddy_free_deferred() instead of buddy_free(). The
+ * block sits in the writer's limbo list, tagged with the epoch it was
+ * retired in, until the global epoch has moved on twice. By then every
+ * reader that could still see it has left its read-side section.
+ *
+ * Grace periods are only checked every BUDDY_EPOCH_BATCH deferred frees
+ * and reclaimed blocks go back through buddy_free_bulk(), so readers never
+ * pay for reclamation. An allocation failing for lack of memory also
+ * reclaims its own thread's expired limbo, see shrink.h. Limbo pages are
+ * mapped on their own, so deferring a free works with the arena full.
+ *
+ * A thread exiting with blocks still in limbo does not wait for them, it
+ * moves its pages to a shared orphan list that the next reclaim of any
+ * thread frees once their grace period is over.
+ */
+
+#define BUDDY_EPOCH_BATCH   64  // deferred frees between reclaim attempts.
+
+extern void buddy_epoch_enter(void);
+extern void buddy_epoch_exit(void);
+extern int  buddy_free_deferred(void *ptr);
+extern void buddy_epoch_barrier(void);
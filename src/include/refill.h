@@ -0,0 +1,20 @@
+#pragma once
+
+#include "defs.h"
+
+/**
+ * Background refill of the low orders.
+ *
+ * buddy_set_watermark() gives an order a low and a high watermark. When an
+ * allocation leaves fewer than 'low' free blocks of its order the refill
+ * thread is kicked, and it pre-splits larger blocks with buddy_refill()
+ * until the order is back at 'high'. Allocations then find their block
+ * ready instead of splitting all the way down from a top block.
+ *
+ * The thread also runs buddy_refill() every 'interval_ms' while idle. It
+ * is stopped by buddy_refill_stop() or when the zone is detached.
+ */
+
+extern int  buddy_refill_start(unsigned interval_ms);
+extern void buddy_refill_stop(void);
+extern void buddy_refill_kick(void);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "defs.h"
+
+/**
+ * Background scavenging of idle free memory.
+ *
+ * The zone stamps every BUDDY_CHUNK_ORDER chunk of its arena with the time
+ * it became wholly free. The scavenger thread runs buddy_scavenge() every
+ * quarter of 'delay_ms', handing the pages of chunks idle for longer than
+ * that back to the OS, those idle the longest first, while more than
+ * 'retain' free bytes stay resident.
+ * A reclaimed chunk is counted in buddy_stats().reclaimed until part of it
+ * is allocated again.
+ *
+ * The thread is stopped by buddy_scavenger_stop() or when the zone is
+ * detached.
+ */
+
+extern int  buddy_scavenger_start(unsigned delay_ms, usize retain, int flags);
+extern void buddy_scavenger_stop(void);
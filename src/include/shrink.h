@@ -0,0 +1,37 @@
+#pragma once
+
+#include "defs.h"
+
+/**
+ * Shrinkers hand memory parked outside the free lists back to the zone
+ * under pressure: caches, deferred frees, buddies kept apart by the
+ * refill, and so on.
+ *
+ * When an allocation from the current zone fails, buddy_shrink() calls
+ * the registered shrinkers cheapest 'cost' first, and stops as soon as a
+ * block of the wanted order is free. The allocation is then retried once.
+ *
+ * When the refill thread cannot bring an order back to its low watermark
+ * it runs one round of buddy_shrink_cost() with BUDDY_SHRINK_REFILL. That
+ * skips the built-in coalescing at cost 0, which would only merge back
+ * the splits the refill keeps apart for other orders.
+ *
+ * A shrinker is called without the zone lock held and may free into the
+ * zone. It returns how much it gave back, 0 for nothing. Allocations it
+ * makes do not recurse into the shrinkers, and it must not register or
+ * unregister shrinkers itself.
+ */
+
+#define BUDDY_NSHRINKER     16  // shrinkers that can be registered at once.
+#define BUDDY_SHRINK_REFILL 1   // least cost the refill thread runs.
+
+typedef usize (*buddy_shrink_t)(void *arg, int order);
+
+extern int   buddy_shrinker_register(buddy_shrink_t fn, void *arg, int cost);
+extern int   buddy_shrinker_unregister(buddy_shrink_t fn, void *arg);
+extern usize buddy_shrink(int order);
+extern usize buddy_shrink_cost(int order, int mincost);
+
+// Hold off shrinker rounds, e.g. across fork().
+extern void  buddy_shrink_lock(void);
+extern void  buddy_shrink_unlock(void);
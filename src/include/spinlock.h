@@ -48,6 +48,19 @@ typedef struct spinlock_t{
     __atomic_clear(&(lk)->guard, __ATOMIC_SEQ_CST);                   \
 })
 
+// Take the lock if it is free, never spins on its holder.
+#define spin_trylock(lk) ({                                       \
+    while (__atomic_test_and_set(&(lk)->guard, __ATOMIC_SEQ_CST)) \
+        asm __volatile__("pause");                                \
+    int taken = !(lk)->locked;                                    \
+    if (taken) {                                                  \
+        (lk)->locked = 1;                                         \
+        (lk)->thread = pthread_self();                            \
+    }                                                             \
+    __atomic_clear(&(lk)->guard, __ATOMIC_SEQ_CST);               \
+    taken;                                                        \
+})
+
 #define spin_unlock(lk) ({                                        \
     while (__atomic_test_and_set(&(lk)->guard, __ATOMIC_SEQ_CST)) \
         asm __volatile__("pause");                                \
@@ -58,3 +71,7 @@ typedef struct spinlock_t{
     (lk)->thread = 0;                                             \
     __atomic_clear(&(lk)->guard, __ATOMIC_SEQ_CST);               \
 })
+
+// In the child of fork(), drop a lock the forking thread held. Not an unlock,
+// a thread spinning on it may have been copied with its guard set.
+#define spin_reset(lk) ({ *(lk) = SPINLOCK_INIT(); })
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "defs.h"
+#include "spinlock.h"
+#include <time.h>
+
+/**
+ * Helpers for the allocator's background threads and per-thread state.
+ *
+ * Per-thread records outlive their thread, a record type starts with a
+ * thread_rec_t. thread_rec_get() adopts a record an exited thread gave up
+ * with thread_rec_put(), or maps a new one and links it onto 'list' under
+ * 'lock'. Records are never unlinked or unmapped, so a list can be walked
+ * without the lock. They are not taken from malloc(), the allocator may
+ * be the one serving it.
+ */
+
+typedef struct thread_rec_t {
+    struct thread_rec_t *next;  // next registered record.
+    u64                 owned;  // held by a live thread.
+} thread_rec_t;
+
+// Walk the records on 'list' as 'type'.
+#define forrecs(elem, list, type)                                       \
+    forlinked(elem, (type *)__atomic_load_n(&(list), __ATOMIC_ACQUIRE), \
+              (type *)(elem)->rec.next)
+
+extern void *thread_rec_get(thread_rec_t **list, spinlock_t *lock, usize size);
+extern void  thread_rec_put(void *rec);
+
+// CLOCK_REALTIME time 'ms' from now, a pthread_cond_timedwait() deadline.
+extern struct timespec thread_deadline(unsigned ms);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "defs.h"
+
+/**
+ * Opt-in alloc/free event tracing.
+ *
+ * Once buddy_trace_start() is called every buddy_alloc()/buddy_free() appends
+ * a fixed size event to a per-thread ring buffer. Events are recorded under
+ * the zone lock but never written there: once a ring is half full its owner
+ * writes it out from buddy_trace_flush(), after dropping the lock, and the
+ * rest are drained by buddy_trace_stop(). An event that finds its ring full,
+ * which takes a single lock hold recording half a ring, is dropped. Rings
+ * of exited threads are handed to new ones. Addresses are arena offsets so
+ * a trace can be replayed on any zone, see tools/replay.c. Only the current
+ * zone is traced, nested zones created from it are not.
+ */
+
+#define BUDDY_TRACE_MAGIC   (0x3143525459444442ull) // "BDDYTRC1"
+#define BUDDY_TRACE_NEVENT  4096  // events per thread ring.
+
+#define BUDDY_EV_ALLOC      1 // block handed out.
+#define BUDDY_EV_FREE       2 // block given back.
+#define BUDDY_EV_NOMEM      3 // allocation that failed.
+#define BUDDY_EV_RESET      4 // zone reset, every block freed at once.
+
+typedef struct buddy_trace_hdr_t {
+    u64         magic;      // BUDDY_TRACE_MAGIC.
+    u64         evsize;     // sizeof (buddy_event_t).
+    u64         pgsz;       // page size orders are relative to.
+    u64         memsize;    // arena size of the traced zone.
+} __packed buddy_trace_hdr_t;
+
+typedef struct buddy_event_t {
+    u64         ts;         // CLOCK_MONOTONIC timestamp in ns.
+    u64         addr;       // arena offset, BUDDY_NIL for NOMEM and RESET.
+    u32         tid;        // kernel thread id.
+    u8          op;         // BUDDY_EV_*.
+    u8          order;      // order of the block.
+    u16         rsvd;
+} __packed buddy_event_t;
+
+extern int buddy_tracing;
+extern __thread int buddy_trace_pending;   // this thread's ring wants writing out.
+
+extern int  buddy_trace_start(const char *path);
+extern int  buddy_trace_stop(void);
+extern void buddy_trace_ring(void);
+extern void buddy_trace_record(int op, int order, u64 addr);
+extern void buddy_trace_sync(void);
+
+// Hold the trace file across fork(), the child then stops tracing.
+extern void buddy_trace_lock(void);
+extern void buddy_trace_unlock(void);
+extern void buddy_trace_fork_child(void);
+
+// Cheap enough to leave in the hot paths, a single load when disabled.
+#define buddy_trace(op, order, addr) ({                               \
+    if (__builtin_expect(__atomic_load_n(&buddy_tracing,              \
+                                         __ATOMIC_RELAXED), 0))       \
+        buddy_trace_record((op), (order), (addr));                    \
+})
+
+// Set up this thread's ring, call without locks held before taking the
+// zone lock. Setting one up maps memory and may call malloc().
+#define buddy_trace_attach() ({                                       \
+    if (__builtin_expect(__atomic_load_n(&buddy_tracing,              \
+                                         __ATOMIC_RELAXED), 0))       \
+        buddy_trace_ring();                                           \
+})
+
+// Write out this thread's ring if it asked for it, call without locks held.
+#define buddy_trace_flush() ({                                        \
+    if (__builtin_expect(buddy_trace_pending, 0))                     \
+        buddy_trace_sync();                                           \
+})
@@ -1,21 +1,37 @@
 #include "include/buddy.h"
+#include "include/buddy_static.h"
 #include <stdio.h>
 
+// 32KiB arena of 4KiB pages, orders 0-3.
+BUDDY_STATIC_DEFINE(tiny, PGSZ, 0, 3)
+
 int main(void) {
+	void *addr[8] = {NULL};
+
 	buddy_init();
 
-	for (int i = 0; i < 8; ++i) {
-		printf("addr: %p\n", buddy_alloc(PGSZ * 2));
+	for (int i = 0; i < 4; ++i) {
+		addr[i] = buddy_alloc(PGSZ * 2);
+		printf("addr: %p\n", addr[i]);
 	}
-	
-	for (int i = 0; i < 8; i += 2)
-		buddy_free((void *)(i * PGSZ));
-	
+
+	for (int i = 0; i < 4; i += 2)
+		buddy_free(addr[i]);
+
 	printf("done freeing...\n");
 	// dump_free_list();
 
 	for (int i = 0; i < 8; ++i) {
 		printf("addr: %p\n", buddy_alloc(PGSZ));
 	}
+
+	buddy_fini();
+
+	tiny_init();
+	for (int i = 0; i < 4; ++i)
+		addr[i] = tiny_alloc(PGSZ * 2);
+	for (int i = 0; i < 4; ++i)
+		tiny_free(addr[i]);
+	printf("tiny: %p\n", tiny_alloc(KiB(32)));
 	return 0;
-}
\ No newline at end of file
+}
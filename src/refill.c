@@ -0,0 +1,74 @@
+#include "include/buddy.h"
+#include "include/refill.h"
+#include "include/thread.h"
+#include <errno.h>
+#include <pthread.h>
+
+static pthread_t        refill_thread;
+static pthread_mutex_t  refill_mutex    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   refill_cond     = PTHREAD_COND_INITIALIZER;
+static int              refill_running  = 0;
+static int              refill_kicked   = 0;
+static unsigned         refill_interval = 0;
+
+static void *refill_main(void *arg __unused) {
+    pthread_mutex_lock(&refill_mutex);
+    while (refill_running) {
+        if (!refill_kicked) {
+            struct timespec ts = thread_deadline(refill_interval);
+            pthread_cond_timedwait(&refill_cond, &refill_mutex, &ts);
+            if (!refill_running) break;
+        }
+
+        __atomic_store_n(&refill_kicked, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&refill_mutex);
+        buddy_refill();
+        pthread_mutex_lock(&refill_mutex);
+    }
+    pthread_mutex_unlock(&refill_mutex);
+    return NULL;
+}
+
+// Start the refill thread, running a pass at least every 'interval_ms'.
+int buddy_refill_start(unsigned interval_ms) {
+    int err = 0;
+
+    if (!interval_ms) return -EINVAL;
+
+    pthread_mutex_lock(&refill_mutex);
+    if (refill_running) {
+        pthread_mutex_unlock(&refill_mutex);
+        return -EBUSY;
+    }
+
+    refill_interval = interval_ms;
+    __atomic_store_n(&refill_running, 1, __ATOMIC_RELEASE);
+    if ((err = pthread_create(&refill_thread, NULL, refill_main, NULL)))
+        __atomic_store_n(&refill_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&refill_mutex);
+    return -err;
+}
+
+void buddy_refill_stop(void) {
+    pthread_mutex_lock(&refill_mutex);
+    if (!refill_running) {
+        pthread_mutex_unlock(&refill_mutex);
+        return;
+    }
+    __atomic_store_n(&refill_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&refill_cond);
+    pthread_mutex_unlock(&refill_mutex);
+
+    pthread_join(refill_thread, NULL);
+}
+
+// Wake the refill thread, cheap when it is already awake or not running.
+void buddy_refill_kick(void) {
+    if (!__atomic_load_n(&refill_running, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&refill_kicked, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    pthread_mutex_lock(&refill_mutex);
+    pthread_cond_signal(&refill_cond);
+    pthread_mutex_unlock(&refill_mutex);
+}
@@ -0,0 +1,63 @@
+#include "include/buddy.h"
+#include "include/scavenge.h"
+#include "include/thread.h"
+#include <errno.h>
+#include <pthread.h>
+
+static pthread_t        scav_thread;
+static pthread_mutex_t  scav_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   scav_cond    = PTHREAD_COND_INITIALIZER;
+static int              scav_running = 0;
+static unsigned         scav_delay   = 0;
+static usize            scav_retain  = 0;
+static int              scav_flags   = 0;
+
+static void *scav_main(void *arg __unused) {
+    unsigned interval = scav_delay / 4 ? scav_delay / 4 : 1;
+
+    pthread_mutex_lock(&scav_mutex);
+    while (scav_running) {
+        struct timespec ts = thread_deadline(interval);
+        pthread_cond_timedwait(&scav_cond, &scav_mutex, &ts);
+        if (!scav_running) break;
+
+        pthread_mutex_unlock(&scav_mutex);
+        buddy_scavenge(scav_delay, scav_retain, scav_flags);
+        pthread_mutex_lock(&scav_mutex);
+    }
+    pthread_mutex_unlock(&scav_mutex);
+    return NULL;
+}
+
+// Start the scavenger thread, see buddy_scavenge() for the arguments.
+int buddy_scavenger_start(unsigned delay_ms, usize retain, int flags) {
+    int err = 0;
+
+    pthread_mutex_lock(&scav_mutex);
+    if (scav_running) {
+        pthread_mutex_unlock(&scav_mutex);
+        return -EBUSY;
+    }
+
+    scav_delay  = delay_ms;
+    scav_retain = retain;
+    scav_flags  = flags;
+    __atomic_store_n(&scav_running, 1, __ATOMIC_RELEASE);
+    if ((err = pthread_create(&scav_thread, NULL, scav_main, NULL)))
+        __atomic_store_n(&scav_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&scav_mutex);
+    return -err;
+}
+
+void buddy_scavenger_stop(void) {
+    pthread_mutex_lock(&scav_mutex);
+    if (!scav_running) {
+        pthread_mutex_unlock(&scav_mutex);
+        return;
+    }
+    __atomic_store_n(&scav_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&scav_cond);
+    pthread_mutex_unlock(&scav_mutex);
+
+    pthread_join(scav_thread, NULL);
+}
@@ -0,0 +1,110 @@
+#include "include/buddy.h"
+#include "include/shrink.h"
+#include <errno.h>
+#include <pthread.h>
+
+typedef struct shrinker_t {
+    buddy_shrink_t  fn;
+    void            *arg;
+    int             cost;
+} shrinker_t;
+
+static usize coalesce_shrink(void *arg __unused, int order __unused) {
+    int nmerge = buddy_coalesce();
+    return nmerge > 0 ? nmerge : 0;
+}
+
+// Kept sorted by cost, merging unmerged buddies is always there and cheapest.
+static shrinker_t       shrinkers[BUDDY_NSHRINKER] = {
+    { .fn = coalesce_shrink, .arg = NULL, .cost = 0 },
+};
+static int              nshrinker       = 1;
+static pthread_mutex_t  shrink_mutex    = PTHREAD_MUTEX_INITIALIZER;
+static __thread int     shrink_active   = 0;
+
+// Register 'fn', called with 'arg', shrinkers of equal cost run in order.
+int buddy_shrinker_register(buddy_shrink_t fn, void *arg, int cost) {
+    if (!fn) return -EINVAL;
+
+    pthread_mutex_lock(&shrink_mutex);
+    for (int i = 0; i < nshrinker; ++i) {
+        if (shrinkers[i].fn == fn && shrinkers[i].arg == arg) {
+            pthread_mutex_unlock(&shrink_mutex);
+            return -EEXIST;
+        }
+    }
+
+    if (nshrinker == BUDDY_NSHRINKER) {
+        pthread_mutex_unlock(&shrink_mutex);
+        return -ENOSPC;
+    }
+
+    int i = nshrinker++;
+    for (; i > 0 && shrinkers[i - 1].cost > cost; --i)
+        shrinkers[i] = shrinkers[i - 1];
+    shrinkers[i] = (shrinker_t){ .fn = fn, .arg = arg, .cost = cost };
+    pthread_mutex_unlock(&shrink_mutex);
+    return 0;
+}
+
+// Once this returns the shrinker is no longer running anywhere.
+int buddy_shrinker_unregister(buddy_shrink_t fn, void *arg) {
+    pthread_mutex_lock(&shrink_mutex);
+    for (int i = 0; i < nshrinker; ++i) {
+        if (shrinkers[i].fn != fn || shrinkers[i].arg != arg)
+            continue;
+
+        for (--nshrinker; i < nshrinker; ++i)
+            shrinkers[i] = shrinkers[i + 1];
+        pthread_mutex_unlock(&shrink_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&shrink_mutex);
+    return -ENOENT;
+}
+
+void buddy_shrink_lock(void) {
+    pthread_mutex_lock(&shrink_mutex);
+}
+
+void buddy_shrink_unlock(void) {
+    pthread_mutex_unlock(&shrink_mutex);
+}
+
+// Whether the current zone has a free block of at least 'order'.
+static int shrink_done(int order) {
+    buddy_stats_t stats;
+    return !buddy_stats(&stats) && stats.maxfree >= order;
+}
+
+/**
+ * Run the shrinkers of at least 'mincost' until a block of 'order' is
+ * free, returns what they gave back. Callers racing in here wait for the
+ * round in progress and return at once if it freed what they need.
+ */
+usize buddy_shrink_cost(int order, int mincost) {
+    usize total = 0;
+
+    if (shrink_active)
+        return 0;
+
+    pthread_mutex_lock(&shrink_mutex);
+    shrink_active = 1;
+
+    for (int i = 0; i < nshrinker && !shrink_done(order); ++i) {
+        if (shrinkers[i].cost >= mincost)
+            total += shrinkers[i].fn(shrinkers[i].arg, order);
+    }
+
+    // Someone else's round may have done the work already.
+    if (!total && shrink_done(order))
+        total = 1;
+
+    shrink_active = 0;
+    pthread_mutex_unlock(&shrink_mutex);
+    return total;
+}
+
+usize buddy_shrink(int order) {
+    return buddy_shrink_cost(order, 0);
+}
@@ -0,0 +1,41 @@
+#include "include/thread.h"
+#include <sys/mman.h>
+
+// Adopt a record given up on 'list', or map one of 'size' bytes and link it.
+void *thread_rec_get(thread_rec_t **list, spinlock_t *lock, usize size) {
+    forlinked(r, __atomic_load_n(list, __ATOMIC_ACQUIRE), r->next) {
+        u64 owned = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &owned, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return r;
+    }
+
+    thread_rec_t *rec = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rec == MAP_FAILED) return NULL;
+
+    rec->owned = 1;
+    spin_lock(lock);
+    rec->next = *list;
+    __atomic_store_n(list, rec, __ATOMIC_RELEASE);
+    spin_unlock(lock);
+    return rec;
+}
+
+// Leave 'rec' and whatever it holds to the next thread that needs one.
+void thread_rec_put(void *rec) {
+    __atomic_store_n(&((thread_rec_t *)rec)->owned, 0, __ATOMIC_RELEASE);
+}
+
+struct timespec thread_deadline(unsigned ms) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000l;
+    if (ts.tv_nsec >= 1000000000l) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000l;
+    }
+    return ts;
+}
@@ -0,0 +1,227 @@
+#include "include/buddy.h"
+#include "include/spinlock.h"
+#include "include/thread.h"
+#include "include/trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per-thread event ring, only its owner advances 'head'.
+typedef struct trace_buf_t {
+    thread_rec_t        rec;    // registered ring.
+    u64                 head;   // next slot to fill.
+    u64                 tail;   // first slot not yet written out.
+    u32                 tid;    // owning thread.
+    buddy_event_t       ev[BUDDY_TRACE_NEVENT];
+} trace_buf_t;
+
+int buddy_tracing = 0;
+__thread int buddy_trace_pending = 0;
+
+static int              trace_fd    = -1;
+static spinlock_t       trace_lock  = SPINLOCK_INIT();
+static thread_rec_t     *trace_bufs = NULL;        // every ring ever registered.
+static pthread_key_t    trace_key;
+static pthread_once_t   trace_once  = PTHREAD_ONCE_INIT;
+static __thread trace_buf_t *trace_buf = NULL;     // this thread's ring.
+
+static u64 trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int trace_write(const void *data, usize size) {
+    const u8 *p = data;
+    while (size) {
+        ssize_t n = write(trace_fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p    += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Write out the filled part of a ring, caller holds trace_lock.
+static void trace_drain(trace_buf_t *buf) {
+    u64 head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+
+    while (buf->tail < head) {
+        u64 slot = buf->tail % BUDDY_TRACE_NEVENT;
+        u64 n    = MIN(head - buf->tail, BUDDY_TRACE_NEVENT - slot);
+
+        // Events are dropped rather than blocking the allocator on a bad fd.
+        if (trace_fd >= 0)
+            trace_write(&buf->ev[slot], n * sizeof(buddy_event_t));
+        __atomic_store_n(&buf->tail, buf->tail + n, __ATOMIC_RELEASE);
+    }
+}
+
+// Thread exit, leave the ring and what is still in it to the next thread.
+static void trace_exit_thread(void *arg) {
+    trace_buf_t *buf = arg;
+
+    trace_buf = NULL;
+    thread_rec_put(buf);
+}
+
+static void trace_init_key(void) {
+    pthread_key_create(&trace_key, trace_exit_thread);
+}
+
+// Get this thread's ring, adopting one left by an exited thread if possible.
+static trace_buf_t *trace_get_buf(void) {
+    trace_buf_t *buf = trace_buf;
+    if (buf) return buf;
+
+    pthread_once(&trace_once, trace_init_key);
+
+    if (!(buf = thread_rec_get(&trace_bufs, &trace_lock, sizeof *buf)))
+        return NULL;
+
+    // Set first, pthread_setspecific() may malloc() and come back here.
+    buf->tid  = syscall(SYS_gettid);
+    trace_buf = buf;
+    pthread_setspecific(trace_key, buf);
+    return buf;
+}
+
+// Get this thread's ring ahead of recording, see buddy_trace_attach().
+void buddy_trace_ring(void) {
+    trace_get_buf();
+}
+
+// Called with the zone lock held, so nothing here may block on I/O or map
+// a ring, events of a thread without one are dropped.
+void buddy_trace_record(int op, int order, u64 addr) {
+    trace_buf_t *buf = trace_buf;
+    if (!buf) return;
+
+    u64 used = buf->head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+    if (used == BUDDY_TRACE_NEVENT)
+        return;
+    if (used + 1 >= BUDDY_TRACE_NEVENT / 2)
+        buddy_trace_pending = 1;
+
+    buddy_event_t *ev = &buf->ev[buf->head % BUDDY_TRACE_NEVENT];
+    ev->ts    = trace_now();
+    ev->addr  = addr;
+    ev->tid   = buf->tid;
+    ev->op    = op;
+    ev->order = order;
+    ev->rsvd  = 0;
+
+    __atomic_store_n(&buf->head, buf->head + 1, __ATOMIC_RELEASE);
+}
+
+// Write out this thread's ring, see buddy_trace_flush().
+void buddy_trace_sync(void) {
+    buddy_trace_pending = 0;
+    if (!trace_buf) return;
+
+    spin_lock(&trace_lock);
+    trace_drain(trace_buf);
+    spin_unlock(&trace_lock);
+}
+
+void buddy_trace_lock(void) {
+    spin_lock(&trace_lock);
+}
+
+void buddy_trace_unlock(void) {
+    spin_unlock(&trace_lock);
+}
+
+/**
+ * In a child of fork(), with trace_lock held since before the fork. The
+ * file is the parent's, so the child drops its copy of the rings and
+ * closes the fd without writing. Rings of threads that did not make it
+ * across are free for the taking.
+ */
+void buddy_trace_fork_child(void) {
+    __atomic_store_n(&buddy_tracing, 0, __ATOMIC_RELAXED);
+    buddy_trace_pending = 0;
+
+    forrecs(buf, trace_bufs, trace_buf_t) {
+        buf->tail = buf->head;
+        if (buf != trace_buf)
+            thread_rec_put(buf);
+    }
+
+    if (trace_fd >= 0)
+        close(trace_fd);
+    trace_fd = -1;
+    spin_reset(&trace_lock);
+}
+
+// Start tracing into 'path', truncating it.
+int buddy_trace_start(const char *path) {
+    buddy_stats_t stats = {0};
+    int err = 0;
+
+    if (!path) return -EINVAL;
+
+    buddy_stats(&stats);
+
+    spin_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        spin_unlock(&trace_lock);
+        return -EBUSY;
+    }
+
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        err = -errno;
+        spin_unlock(&trace_lock);
+        return err;
+    }
+
+    buddy_trace_hdr_t hdr = {
+        .magic   = BUDDY_TRACE_MAGIC,
+        .evsize  = sizeof(buddy_event_t),
+        .pgsz    = PGSZ,
+        .memsize = stats.memsize,
+    };
+
+    if ((err = trace_write(&hdr, sizeof hdr))) {
+        close(trace_fd);
+        trace_fd = -1;
+        spin_unlock(&trace_lock);
+        return err;
+    }
+
+    // Forget whatever was recorded while no trace was running.
+    forrecs(buf, trace_bufs, trace_buf_t) {
+        buf->tail = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+    }
+    spin_unlock(&trace_lock);
+
+    __atomic_store_n(&buddy_tracing, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Stop tracing, draining every thread's ring into the trace file.
+int buddy_trace_stop(void) {
+    __atomic_store_n(&buddy_tracing, 0, __ATOMIC_RELEASE);
+
+    spin_lock(&trace_lock);
+    if (trace_fd < 0) {
+        spin_unlock(&trace_lock);
+        return -EINVAL;
+    }
+
+    forrecs(buf, trace_bufs, trace_buf_t) {
+        trace_drain(buf);
+    }
+
+    int err = close(trace_fd) ? -errno : 0;
+    trace_fd = -1;
+    spin_unlock(&trace_lock);
+    return err;
+}
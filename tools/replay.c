@@ -0,0 +1,202 @@
+#include "../src/include/buddy.h"
+#include "../src/include/trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Replay a trace captured with buddy_trace_start() through buddy_alloc() and
+ * buddy_free(), reporting throughput and fragmentation.
+ *
+ * usage: replay [-m arena-KiB] trace
+ *
+ * The arena defaults to the size of the traced zone. Events are replayed
+ * in timestamp order on a single thread.
+ */
+
+// Maps a traced arena offset to the pointer handed out during replay.
+typedef struct slot_t {
+    u64     addr;
+    void    *ptr;
+} slot_t;
+
+static slot_t   *slots = NULL;
+static usize    nslot  = 0;
+
+static u64 now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static slot_t *lookup(u64 addr) {
+    usize i = (addr / PGSZ) & (nslot - 1);
+    while (slots[i].ptr && slots[i].addr != addr)
+        i = (i + 1) & (nslot - 1);
+    return &slots[i];
+}
+
+// Open addressing with backward-shift deletion, no tombstones.
+static void unmap(slot_t *s) {
+    usize i = s - slots;
+    usize j = i;
+
+    slots[i].ptr = NULL;
+    loop() {
+        j = (j + 1) & (nslot - 1);
+        if (!slots[j].ptr) break;
+
+        usize home = (slots[j].addr / PGSZ) & (nslot - 1);
+        if (((j - home) & (nslot - 1)) >= ((j - i) & (nslot - 1))) {
+            slots[i] = slots[j];
+            slots[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+static int cmp_event(const void *a, const void *b) {
+    const buddy_event_t *x = a, *y = b;
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+// 1 - largest free block / free memory, 0 when there is nothing free.
+static double fragmentation(void) {
+    buddy_stats_t stats;
+    if (buddy_stats(&stats) || !stats.free)
+        return 0.0;
+    return 1.0 - (double)(PGSZ << stats.maxfree) / stats.free;
+}
+
+int main(int argc, char *argv[]) {
+    usize memsize = 0;
+    int   opt;
+
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        switch (opt) {
+        case 'm':
+            memsize = KiB(strtoull(optarg, NULL, 0));
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1)
+        goto usage;
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if (!fp) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    buddy_trace_hdr_t hdr;
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1 || hdr.magic != BUDDY_TRACE_MAGIC ||
+        hdr.evsize != sizeof(buddy_event_t)) {
+        fprintf(stderr, "%s: not a buddy trace\n", argv[optind]);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    usize nevent = (ftell(fp) - sizeof hdr) / sizeof(buddy_event_t);
+    fseek(fp, sizeof hdr, SEEK_SET);
+
+    buddy_event_t *events = calloc(nevent ? nevent : 1, sizeof *events);
+    if (!events || fread(events, sizeof *events, nevent, fp) != nevent) {
+        fprintf(stderr, "%s: short read\n", argv[optind]);
+        return 1;
+    }
+    fclose(fp);
+
+    // Rings are flushed per thread, put the events back in program order.
+    qsort(events, nevent, sizeof *events, cmp_event);
+
+    for (nslot = 64; nslot < nevent * 2; nslot <<= 1);
+    if (!(slots = calloc(nslot, sizeof *slots))) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if (!memsize)
+        memsize = hdr.memsize;
+
+    int err = buddy_init_size(memsize);
+    if (err) {
+        fprintf(stderr, "buddy_init_size(%lu): %s\n", memsize, strerror(-err));
+        return 1;
+    }
+
+    usize  nalloc = 0, nfree = 0, nfail = 0, nskip = 0, nreset = 0, peak = 0;
+    double frag = 0.0, maxfrag = 0.0;
+    u64    elapsed = 0;
+
+    for (usize i = 0; i < nevent; ++i) {
+        buddy_event_t *ev = &events[i];
+        buddy_stats_t stats;
+
+        if (ev->op == BUDDY_EV_ALLOC) {
+            u64 start = now();
+            void *ptr = buddy_alloc(hdr.pgsz << ev->order);
+            elapsed += now() - start;
+
+            if (!ptr) {
+                nfail++;
+                continue;
+            }
+            slot_t *s = lookup(ev->addr);
+            s->addr = ev->addr;
+            s->ptr  = ptr;
+            nalloc++;
+        } else if (ev->op == BUDDY_EV_FREE) {
+            slot_t *s = lookup(ev->addr);
+            if (!s->ptr) {
+                // Its allocation failed here or predates the trace.
+                nskip++;
+                continue;
+            }
+            u64 start = now();
+            buddy_free(s->ptr);
+            elapsed += now() - start;
+
+            unmap(s);
+            nfree++;
+        } else if (ev->op == BUDDY_EV_RESET) {
+            u64 start = now();
+            buddy_zone_reset(NULL);
+            elapsed += now() - start;
+
+            // Everything live went with it.
+            memset(slots, 0, nslot * sizeof *slots);
+            nreset++;
+        } else {
+            continue;
+        }
+
+        buddy_stats(&stats);
+        peak    = MAX(peak, stats.used);
+        frag    = fragmentation();
+        maxfrag = frag > maxfrag ? frag : maxfrag;
+    }
+
+    usize nop = nalloc + nfree + nfail;
+    printf("events:        %lu\n", nevent);
+    printf("arena:         %lu KiB\n", memsize / 1024);
+    printf("allocs:        %lu (%lu failed)\n", nalloc, nfail);
+    printf("frees:         %lu (%lu skipped)\n", nfree, nskip);
+    printf("resets:        %lu\n", nreset);
+    printf("time:          %.3f ms, %.1f ns/op\n", elapsed / 1e6,
+           nop ? (double)elapsed / nop : 0.0);
+    printf("peak used:     %lu KiB\n", peak / 1024);
+    printf("fragmentation: %.3f final, %.3f max\n", frag, maxfrag);
+
+    buddy_fini();
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-m arena-KiB] trace\n", argv[0]);
+    return 1;
+}